@@ -12,6 +12,7 @@
 #define ADC_DRIVER_H
 #include "board.h"
 #include "avr_compiler.h"
+#include "fixmath.h"
 
 /* Defines */
 
@@ -27,6 +28,44 @@
 #define CURRENT_OFFSET 0
 // offset on the angle measurement (degrees)
 #define ANGLE_OFFSET   32
+// Acquisition mode. When set to 1 the conversions are not free running but are
+// triggered through the event system by the servo timer, so that the currents
+// are sampled while the pulses are high. When set to 0 the ADC continuously
+// scans all the channels as fast as it can.
+// With SERVO_STAGGER each servo current is sampled by its own burst, started
+// at the centre of its pulse.
+#define ADC_PWM_SYNC   1
+// Timer count at which the conversion bursts are triggered. The trigger timer
+// runs in dual slope mode so the compare match happens twice per frame: once
+// counting down (just before the centre of the pulses) and once counting up.
+// A pulse is high as long as the count is below its compare value, so this
+// value plus the length of a burst must stay below SERVO_PWM_MIN.
+// With SERVO_STAGGER the bursts of the other servos are started by the same
+// amount before or after the centre of their pulses.
+#define ADC_TRIGGER_COMP 200
+// Duration of a single conversion, measured in servo timer counts
+#define ADC_CONV_TICKS   20
+// When set to 1 every current sample is compared against the servo limit as
+// soon as the conversion is complete and the servo pulse is cut on overcurrent.
+// See servo_trip()
+#define ADC_OVERCURRENT_TRIP 1
+
+// Filter stage applied to each channel. ADC_FILTER_IIR(k) is a single pole
+// filter y += (x - y) / 2^k while ADC_FILTER_BOXCAR averages the last
+// ADC_BOXCAR_LEN decimated samples.
+#define ADC_FILTER_NONE    0x00
+#define ADC_FILTER_IIR(_k) (0x40 | (_k))
+#define ADC_FILTER_BOXCAR  0x80
+#define ADC_BOXCAR_LEN     4
+// Filter used by each kind of channel
+#define CURRENT_FILTER     ADC_FILTER_IIR(1)
+#define ANGLE_FILTER       ADC_FILTER_IIR(2)
+#define BATTERY_FILTER     ADC_FILTER_BOXCAR
+// Oversampling: 4^n samples are summed and decimated to gain n more bits of
+// resolution before filtering. n must be between 0 and 2.
+#define CURRENT_OVERSAMPLE 1
+#define ANGLE_OVERSAMPLE   0
+#define BATTERY_OVERSAMPLE 0
 
 /* Macros */
 
@@ -294,9 +333,42 @@
 struct ADC_Conversion_t {
 	uint8_t gain;
 	uint8_t muxposPin;
-	int16_t result;
+	int16_t result;      // last raw sample
+	uint8_t filter;      // ADC_FILTER_* setting for this channel
+	uint8_t oversample;  // 4^oversample samples are summed each time
+	uint8_t nSamples;    // samples summed so far
+	uint16_t acc;        // oversampling accumulator
+	uint16_t box[ADC_BOXCAR_LEN]; // boxcar filter history
+	uint8_t boxIndex;
+	uint16_t filtered;   // filter output, left adjusted to 16 bits
 };
 
+/*
+ * A coherent set of filtered readings. The ADC driver publishes one at the end
+ * of every scan frame, so all the values come from the same frame.
+ */
+struct ADC_Frame_t {
+	uint16_t current[5]; // see ADC_getServoCurrent16()
+	uint16_t angle[5];   // see ADC_getServoAngle16()
+	uint16_t battery;    // see ADC_getBatteryVoltage16()
+	uint8_t  seq;        // incremented each time a frame is published
+};
+
+/* Conversions from the 16 bit filtered readings to physical units */
+static inline uint8_t ADC_current2mA(const uint16_t current16)
+{
+	uint16_t tempC = current16 >> 5;
+	//tempC = (tempC * 3125) / 3072; // same as 1 (1% rounding error)
+	if (tempC > 255)
+		tempC = 255;
+	return (tempC - CURRENT_OFFSET);
+}
+
+static inline uint8_t ADC_angle2deg(const uint16_t angle16)
+{
+	return fix_adc2deg(angle16) - ANGLE_OFFSET;
+}
+
 /* Prototypes for functions. */
 void ADC_init();
 
@@ -306,6 +378,54 @@ uint8_t ADC_getServoAngle(uint8_t servo_num);
 
 uint8_t ADC_getBatteryVoltage();
 
+/*
+ * Set the current (mA) above which the servo is tripped by the ADC interrupt.
+ * 255 disables the check.
+ */
+void ADC_setTripCurrent(uint8_t servo_num, uint8_t current_mA);
+
+/*
+ * Highest current (mA) among the unfiltered samples of the last current burst
+ * of a servo. It is updated at the end of each burst, not of the whole scan:
+ * with SERVO_STAGGER each servo gets a new value at the centre of its own
+ * pulse, at a different time of the frame. Used by the control loop for the
+ * current limits, the filtered current only changes every
+ * 4^CURRENT_OVERSAMPLE / ADC_CURRENT_SLOTS frames.
+ */
+uint8_t ADC_getBurstCurrent(uint8_t servo_num);
+
+/*
+ * Highest current (mA) of a servo since the last reset, from the single
+ * samples of the current bursts.
+ * With SERVO_STAGGER each servo is sampled in the burst of its own pulse, so
+ * the servos are never sampled at the same time and adding these peaks does
+ * not give the peak of the total current: the board has no sensor for it.
+ */
+uint8_t ADC_getPeakCurrent(uint8_t servo_num);
+
+void ADC_resetPeakCurrent(uint8_t servo_num);
+
+/*
+ * Filtered readings at full precision. The 12 bit (positive) result is left
+ * adjusted to 16 bits so the extra resolution given by oversampling and
+ * filtering is preserved. Shift right by 5 to get raw ADC counts.
+ */
+uint16_t ADC_getServoCurrent16(uint8_t servo_num);
+
+uint16_t ADC_getServoAngle16(uint8_t servo_num);
+
+uint16_t ADC_getBatteryVoltage16();
+
+/*! \brief Copy the last complete frame of readings.
+ *
+ *  Frames are double buffered: the ADC interrupt fills the back buffer and
+ *  swaps it with the front one once the scan is complete. The copy is retried
+ *  if a new frame is published meanwhile, so interrupts are never disabled.
+ *
+ *  \param  frame  Where the readings are copied.
+ */
+void ADC_getFrame(struct ADC_Frame_t* frame);
+
 /*! \brief This function get the calibration data from the production calibration.
  *
  *  The calibration data is loaded from flash and stored in the calibration
@@ -52,6 +52,21 @@
 	#define PINKY_TIMER   TCC0
 	#define pinkySetCompare(_comp)  TC_SetCompareA( &PINKY_TIMER, _comp )
 
+	// Registers driving a servo output, in the order of servo_output_t (see
+	// servo_driver.c). The servos sharing a timer must be consecutive. The
+	// pins of the inverted outputs are configured in servo_init().
+	#define SERVO_OUTPUT( _tc, _ch, _inv ) { &(_tc).CC##_ch##BUF,      \
+		&(_tc).CC##_ch, &(_tc).CTRLB, TC0_CC##_ch##EN_bm, _inv }
+
+	#define THUMB_OUTPUT  SERVO_OUTPUT( THUMB_TIMER, A, false )
+	#define INDEX_OUTPUT  SERVO_OUTPUT( INDEX_TIMER, B, false )
+	#define MIDDLE_OUTPUT SERVO_OUTPUT( MIDDLE_TIMER, A, SERVO_STAGGER )
+	#define RING_OUTPUT   SERVO_OUTPUT( RING_TIMER, B, false )
+	#define PINKY_OUTPUT  SERVO_OUTPUT( PINKY_TIMER, A, SERVO_STAGGER )
+
+	// Timer running the servo control loop, see CONTROL_RATE_HZ
+	#define CONTROL_TIMER TCD1
+
 	#define THUMB_CURRENT_PIN  ADC_CH_MUXPOS_PIN9_gc
 	#define THUMB_ANGLE_PIN    ADC_CH_MUXPOS_PIN10_gc
 
@@ -68,7 +83,36 @@
 	#define PINKY_ANGLE_PIN    ADC_CH_MUXPOS_PIN0_gc
 
 	/**
-	 * Commands supported through the wifi link
+	 * Event system routing used to synchronize the ADC with the servo pulses.
+	 * The spare compare channel B of the thumb timer is used as trigger. Its
+	 * output is never enabled, only the compare match event is used.
+	 * With SERVO_STAGGER the spare channels C and D of the same timer match
+	 * at the phase of the index and ring timers: counting up they find the
+	 * index and ring pulses, counting down the pinky and middle ones.
+	 */
+	#define ADC_TRIGGER_TIMER  TCD0
+	#define ADC_TRIGGER_EVENT  EVSYS_CHMUX_TCD0_CCB_gc
+	#define adcSetTriggerCompare(_comp) TC_SetCompareB( &ADC_TRIGGER_TIMER, _comp )
+	#define ADC_TRIGGER_EVENT_INDEX EVSYS_CHMUX_TCD0_CCC_gc
+	#define adcSetIndexTriggerCompare(_comp) \
+		TC_SetCompareC( &ADC_TRIGGER_TIMER, _comp )
+	#define ADC_TRIGGER_EVENT_RING  EVSYS_CHMUX_TCD0_CCD_gc
+	#define adcSetRingTriggerCompare(_comp) \
+		TC_SetCompareD( &ADC_TRIGGER_TIMER, _comp )
+
+	/**
+	 * ADC scan schedule. In each frame every servo current is sampled
+	 * ADC_CURRENT_SLOTS times and every angle ADC_ANGLE_SLOTS times (1 to 4).
+	 * The battery voltage is only sampled once every ADC_BATTERY_FRAMES frames.
+	 */
+	#define ADC_CURRENT_SLOTS  2
+	#define ADC_ANGLE_SLOTS    1
+	#define ADC_BATTERY_FRAMES 25
+
+	/**
+	 * Commands supported through the wifi link. A host can write a batch of
+	 * commands back to back with a single send, high byte first: they are
+	 * queued together (see COMMAND_QUEUE_SIZE) and executed in order.
 	 */
 	union wifiCommand
 	{
@@ -97,9 +141,98 @@
 
 	#define WIFI_GET_ANGLE   0x05
 	#define WIFI_GET_CURRENT 0x06
-	#define WIFI_GET_SPEED   0x07
+	#define WIFI_GET_SPEED   0x07 // measured, degrees/s
+	#define WIFI_GET_FAULT   0x08 // data: mask of the tripped servos
+	#define WIFI_CALIBRATE   0x09 // data: 1 on success, 0 on failure. The
+	                              // answer comes after the sweep, about 5.5 s.
+	                              // Refused (0) while a sequence or another
+	                              // sweep is running
+	#define WIFI_SET_PARAM   0x0A // set the selected parameter of a servo
+	#define WIFI_SEL_PARAM   0x0B // data: parameter used by SET/GET_PARAM
+	#define WIFI_GET_PARAM   0x0C // data: value of the selected parameter
+	#define WIFI_MOVE_POSE   0x0D // servo 0-4: data is the angle of that finger
+	                              // in the next pose. servo WIFI_POSE_GO:
+	                              // move, data is the duration (50 ms)
+
+	#define WIFI_POSE        0x0E // servo: one of WIFI_POSE_*, data: pose id
+
+	#define WIFI_POSE_GO     0x0F
+	#define WIFI_POSE_TIME_MS 50
+
+	#define WIFI_POSE_RUN    0x00 // data: 1 on success, 0 if not saved
+	#define WIFI_POSE_SAVE   0x01 // save the current setpoints. data: 1 on
+	                              // success
+	#define WIFI_POSE_DELETE 0x02
+	#define WIFI_POSE_LIST   0x03 // data: mask of the valid poses from id
+	                              // to id + 7
+	#define WIFI_POSE_TIME   0x04 // data: duration used by the next SAVE
+	                              // (WIFI_POSE_TIME_MS), 0 = own speed
+
+	#define WIFI_SEQ         0x0F // servo: one of WIFI_SEQ_*
+
+	#define WIFI_SEQ_SELECT  0x00 // data: keyframe edited by the next commands
+	#define WIFI_SEQ_POSE    0x01 // data: pose id of the keyframe
+	#define WIFI_SEQ_MODE    0x02 // data: WIFI_MODE_* or 0xFF to keep it
+	#define WIFI_SEQ_CURRENT 0x03 // data: current limit (mA) or 0xFF
+	#define WIFI_SEQ_DWELL   0x04 // data: wait after the keyframe (50 ms)
+	#define WIFI_SEQ_LENGTH  0x05 // data: number of keyframes
+	#define WIFI_SEQ_START   0x06 // data: 1 to loop, 0 to run once. The
+	                              // answer is WIFI_SEQ_REFUSED during a
+	                              // calibration or for a loop with no dwell
+	#define WIFI_SEQ_STOP    0x07
+	#define WIFI_SEQ_PAUSE   0x08 // data: 1 to pause, 0 to resume
+	#define WIFI_SEQ_SAVE    0x09 // store the sequence in EEPROM
+	#define WIFI_SEQ_LOAD    0x0A
+	#define WIFI_SEQ_STATUS  0x0B // data: state << 6 | next keyframe
+
+	#define WIFI_SEQ_REFUSED 0xFF
 
 	#define WIFI_MODE_FOLLOW 0x00
 	#define WIFI_MODE_ANGLE  0x01
 	#define WIFI_MODE_HOLD   0x02
+	#define WIFI_MODE_PID    0x03
+
+	#define WIFI_PARAM_KP    0x00 // PID gains, Q4.4 fixed point
+	#define WIFI_PARAM_KI    0x01
+	#define WIFI_PARAM_KD    0x02
+	#define WIFI_PARAM_ACCEL 0x03 // maximum acceleration (10 degrees/s^2),
+	                              // 0 = constant speed
+	#define WIFI_PARAM_PEAK  0x04 // highest current of the servo (mA), read
+	                              // only. Writing resets the measurement
+	                              // 0x05 is not used
+	#define WIFI_PARAM_FORCE 0x06 // HOLD mode force setpoint (mA)
+	#define WIFI_PARAM_FORCE_KP 0x07 // HOLD mode PI gains, Q4.4 fixed point
+	#define WIFI_PARAM_FORCE_KI 0x08
+	#define WIFI_PARAM_FORCE_BAND 0x09 // HOLD mode deadband (mA)
+	#define WIFI_PARAM_FORCE_RATE 0x0A // HOLD mode maximum speed (degrees/s)
+	#define WIFI_PARAM_EVENTS 0x0B // WIFI_EVENTS_* flags
+	#define WIFI_PARAM_CONTACT 0x0C // current increase meaning contact
+	                               // (mA per frame)
+	#define WIFI_PARAM_STALL 0x0D // distance between reference and measured
+	                              // angle meaning stall (degrees)
+	#define WIFI_PARAM_DETACH 0x0E // ANGLE mode settle time before the pulses
+	                               // stop (100 ms), 0 never stops them
+	#define WIFI_PARAM_DETACH_BAND 0x0F // ANGLE mode movement of the measured
+	                                    // angle considered settled (degrees)
+	#define WIFI_PARAM_TELEMETRY 0x10 // rate of the telemetry frames (Hz) for
+	                                  // the whole hand, 0 stops them. The
+	                                  // answer holds the rate actually used
+
+	#define WIFI_EVENTS_DETECT 0x01 // look for contact and stall
+	#define WIFI_EVENTS_HOLD   0x02 // switch to HOLD mode on an event
+	#define WIFI_EVENTS_REPORT 0x04 // send the events to the host
+
+	// Unsolicited message, sent when enabled with WIFI_EVENTS_REPORT to the
+	// last client which set that flag. servo: finger, data: one of WIFI_EVENT_*
+	#define WIFI_EVENT       0x00
+
+	#define WIFI_EVENT_CONTACT 0x01
+	#define WIFI_EVENT_STALL   0x02
+
+	// Unsolicited message, header of a telemetry frame enabled with
+	// WIFI_PARAM_TELEMETRY. Same code as WIFI_EVENT, told apart by servo
+	// WIFI_TELEMETRY_FRAME, see telemetry_driver.h
+	#define WIFI_TELEMETRY   0x00
+
+	#define WIFI_TELEMETRY_FRAME 0x0F
 #endif
@@ -0,0 +1,89 @@
+/**
+ * Per servo angle calibration.
+ *
+ * Each finger is swept through CALIB_POINTS compare values between
+ * SERVO_PWM_MIN and SERVO_PWM_MAX and the feedback potentiometer is read at
+ * each one. The resulting tables are saved in EEPROM and loaded at boot into
+ * RAM lookup tables used to convert angles to compare values and feedback
+ * readings to angles.
+ *
+ * The potentiometer is taken as the reference: 0 and 180 degrees are the
+ * feedback readings at the two ends of the sweep and the angle is linear with
+ * the reading in between. The compare value for each angle is interpolated
+ * from the sweep, so nonlinearities and offsets of every servo are corrected.
+ * Servos which have never been calibrated use the nominal conversions found in
+ * fixmath.h and adc_driver.h.
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+#ifndef CALIB_DRIVER_H
+#define CALIB_DRIVER_H
+
+	#include <stdbool.h>
+	#include <stdint.h>
+
+	/**
+	 * Configuration directives
+	 */
+	// Number of points of each calibration sweep
+	#define CALIB_POINTS    10
+	// Time given to the servo to reach each point (ms)
+	#define CALIB_SETTLE_MS 500
+	// Minimum feedback increase between two points (raw ADC counts). Smaller
+	// steps mean the finger is stuck or the potentiometer is not connected
+	#define CALIB_MIN_STEP  4
+
+	/**
+	 * Load the calibration tables from EEPROM and build the lookup tables
+	 */
+	void calib_init();
+
+	/**
+	 * Start sweeping a servo. The sweep is driven by calib_poll() and lasts
+	 * about (CALIB_POINTS + 1) * CALIB_SETTLE_MS ms. Returns false if the
+	 * servo number is not valid or another sweep is running.
+	 */
+	bool calib_start(const uint8_t servo_num);
+
+	/**
+	 * Go on with the sweep, called by the main loop. Returns true once, when
+	 * the sweep is over: the new table is then stored in EEPROM and used, and
+	 * success is set. success is false if the feedback did not follow the
+	 * sweep, in which case the old calibration is kept.
+	 */
+	bool calib_poll(bool* success);
+
+	/**
+	 * Return true while a sweep is running
+	 */
+	bool calib_isRunning();
+
+	/**
+	 * Convert an angle in degrees into a capture-compare value for the chosen
+	 * servo. Angles above 180 are cropped.
+	 */
+	uint16_t calib_deg2comp(const uint8_t servo_num, const uint8_t angle);
+
+	/**
+	 * Same as calib_deg2comp() for an angle in Q8.8 fixed point. The value is
+	 * interpolated between the two nearest degrees.
+	 */
+	uint16_t calib_deg2compQ8(const uint8_t servo_num, const uint16_t angle);
+
+	/**
+	 * Convert a capture-compare value into an angle for the chosen servo
+	 */
+	uint8_t calib_comp2deg(const uint8_t servo_num, const uint16_t comp);
+
+	/**
+	 * Convert a 16 bit filtered angle reading (see adc_driver.h) into an angle
+	 * for the chosen servo
+	 */
+	uint8_t calib_adc2deg(const uint8_t servo_num, const uint16_t angle16);
+
+	/**
+	 * Same as calib_adc2deg() with the result in Q8.8 fixed point, interpolated
+	 * between the two nearest table entries.
+	 */
+	uint16_t calib_adc2degQ8(const uint8_t servo_num, const uint16_t angle16);
+#endif
@@ -8,22 +8,65 @@
 	#include "include/usart_driver.h"
 	#include "include/utils.h"
 
+	/**
+	 * Link mode. 0: TCP server on port 333, commands and replies framed by the
+	 * AT commands of the ESP8266 (+IPD and AT+CIPSEND), up to 5 clients, each
+	 * one getting the answers to its commands.
+	 * 1: single UDP link in transparent mode (AT+CIPMODE=1), the commands and
+	 * replies are the only traffic on the serial port. Replies go to the last
+	 * host that sent a datagram to ESP_UDP_PORT.
+	 * In transparent mode each command, both ways, is a four byte frame:
+	 * ESP_UDP_SYNC, the two bytes of the command and ESP_UDP_CHECK() of them.
+	 * A frame with a wrong check byte is dropped and the parser waits for the
+	 * next ESP_UDP_SYNC, so a lost or extra byte costs one command only.
+	 */
+	#define ESP_UDP      0
+	#define ESP_UDP_PORT 333
+	#define ESP_UDP_SYNC 0xA5
+	#define ESP_UDP_CHECK(_b0, _b1) ((uint8_t) (ESP_UDP_SYNC ^ (_b0) ^ (_b1)))
+
 	/**
 	 * Size of the command queue in number of commands. Old commands will be
-	 * overwritten.
+	 * overwritten. A single +IPD packet may carry a whole batch of commands,
+	 * all of them are queued at once.
+	 */
+	#define COMMAND_QUEUE_SIZE 64
+
+	/**
+	 * Replies are sent in batches with a single AT+CIPSEND: a batch starts when
+	 * esp_flush() is called or when ESP_TX_BATCH replies are waiting, and
+	 * carries up to ESP_TX_BATCH replies.
+	 */
+	#define ESP_TX_BATCH 32
+
+	// No connection, see esp_getClosed()
+	#define ESP_NO_LINK 0xFF
+
+	/**
+	 * A batch the ESP does not answer within this time (ms), with '>' to the
+	 * AT+CIPSEND or with SEND OK to the data, is dropped, see esp_poll().
 	 */
-	#define COMMAND_QUEUE_SIZE 8
+	#define ESP_TX_TIMEOUT_MS 500
+
+	/**
+	 * The replies are flushed as soon as all the commands of the last packet
+	 * have been executed, see esp_isReceiving(). While a packet is still
+	 * coming in the main loop waits at most this time (ms) after the last
+	 * command before flushing anyway.
+	 */
+	#define ESP_COALESCE_MS 8
 
 	/**
 	 * The command parser is a state machine. This enum defines its states
 	 */
 	typedef enum {
 		BEGIN,       // receive data and analyze its value
-		SKIP_TO_LENGTH, // receive data ignoring its value
-		COMPUTE_LEN, // compute the length of received data
-		SKIP_TO_DATA,
+		SKIP_TO_LINK, // receive data ignoring its value
+		READ_LINK,   // read the connection the data comes from
+		COMPUTE_LEN, // compute the length of received data, up to ':'
 		FETCH_HIGH,  // Fetch the high byte of the command
-		FETCH_LOW    // Fetch the low byte of the command
+		FETCH_LOW,   // Fetch the low byte of the command
+		FETCH_CHECK  // Fetch the check byte of the command (ESP_UDP)
 	} esp_state_t;
 
 	/**
@@ -42,8 +85,54 @@
 	union wifiCommand esp_getCommand(const bool blocking);
 
 	/**
-	 * Send a command through the wifi link.
-	 * If the link is not ready it will fail silently.
+	 * Return true if at least one command is waiting in the queue
+	 */
+	bool esp_hasCommand();
+
+	/**
+	 * Return true while a +IPD packet is being received, i.e. more commands
+	 * of the same batch are on their way. Always false with ESP_UDP.
+	 */
+	bool esp_isReceiving();
+
+	/**
+	 * Return the connection (0-4) the last command returned by
+	 * esp_getCommand() comes from. Always 0 with ESP_UDP.
+	 */
+	uint8_t esp_getLink();
+
+	/**
+	 * Return the mask of the connections closed (n,CLOSED from the ESP) since
+	 * the last call, bit n for connection n. Always 0 with ESP_UDP.
+	 */
+	uint8_t esp_getClosed();
+
+	/**
+	 * Queue a command to be sent through the wifi link, see esp_flush(). It
+	 * goes to the connection of the last command received, so each client
+	 * gets its own answers.
+	 * If the link is not ready or the queue is full it will fail silently.
 	 */
 	void esp_sendCommand(const union wifiCommand cmd);
+
+	/**
+	 * Same as esp_sendCommand() for a chosen connection.
+	 */
+	void esp_sendCommandTo(const union wifiCommand cmd, const uint8_t link);
+
+	/**
+	 * Number of commands that can be queued before the oldest are dropped.
+	 */
+	uint8_t esp_txFree();
+
+	/**
+	 * Start sending all the queued commands, in batches of up to ESP_TX_BATCH.
+	 */
+	void esp_flush();
+
+	/**
+	 * Drop the batch being sent if the ESP has not answered for
+	 * ESP_TX_TIMEOUT_MS. now is a time in ms, to be called from the main loop.
+	 */
+	void esp_poll(const uint16_t now);
 #endif
@@ -0,0 +1,58 @@
+/**
+ * Fixed point conversion kernels between ADC readings, angles and servo
+ * capture-compare values.
+ *
+ * The AVR has no hardware divider, so every conversion here is done with
+ * multiplications by precomputed reciprocals or with lookup tables stored in
+ * flash. See tests/fixbench.c for a comparison with the plain formulas.
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+#ifndef FIXMATH_H
+#define FIXMATH_H
+
+	#include <stdint.h>
+
+	#include "include/avr_compiler.h"
+	#include "include/servo_driver.h"
+
+	/**
+	 * Capture-compare value for each angle between 0 and 180 degrees
+	 */
+	extern const uint16_t deg2compTable[181] PROGMEM;
+
+	/**
+	 * Convert an angle in degrees into a valid capture-compare value.
+	 * Angles above 180 are cropped.
+	 */
+	static inline uint16_t fix_deg2comp(const uint8_t angle)
+	{
+		uint8_t a = (angle > 180) ? 180 : angle;
+		return pgm_read_word(&deg2compTable[a]);
+	}
+
+	/**
+	 * Convert a capture-compare value into an angle in degrees.
+	 * (comp - SERVO_PWM_MIN) * 9 / 100 using the reciprocal 11797 / 2^17, which
+	 * is exact over the whole servo range.
+	 */
+	static inline uint8_t fix_comp2deg(const uint16_t comp)
+	{
+		return ((uint32_t) (uint16_t) (comp - SERVO_PWM_MIN) * 11797) >> 17;
+	}
+
+	/**
+	 * Convert a 16 bit filtered angle reading (see adc_driver.h) into degrees,
+	 * before the offset is removed.
+	 * raw * 45 / 512 computed as a 16 bit product whose high byte is taken.
+	 */
+	static inline uint8_t fix_adc2deg(const uint16_t angle16)
+	{
+		return ((angle16 >> 6) * 45) >> 8;
+	}
+
+	/**
+	 * Integer square root (rounded down), bit by bit without divisions
+	 */
+	uint16_t fix_sqrt(uint32_t x);
+#endif
@@ -0,0 +1,64 @@
+/**
+ * Library of hand poses stored in EEPROM.
+ *
+ * A pose holds the target angle, speed and current limit of every finger and
+ * the duration of the move. The whole library is loaded in RAM at boot, so a
+ * pose can be run with a single command without waiting for the EEPROM.
+ * Poses are saved from the current setpoints of the servos.
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+#ifndef POSE_DRIVER_H
+#define POSE_DRIVER_H
+
+	#include <stdbool.h>
+	#include <stdint.h>
+
+	/**
+	 * Configuration directives
+	 */
+	// Number of poses in the library (at most 16)
+	#define POSE_COUNT 16
+
+	struct pose_t
+	{
+		uint8_t angle[5];   // 0 if the finger is not part of the pose
+		uint8_t speed[5];   // degrees/s
+		uint8_t current[5]; // mA
+		uint8_t duration;   // WIFI_POSE_TIME_MS units, 0 to move each finger
+		                    // at its own speed
+	};
+
+	/**
+	 * Load the pose library from EEPROM
+	 */
+	void pose_init();
+
+	/**
+	 * Store the current setpoints of the servos as pose id. The fingers
+	 * will reach the pose together in duration * WIFI_POSE_TIME_MS, or each
+	 * at its own speed if duration is 0.
+	 * Returns false if id is not valid.
+	 */
+	bool pose_save(const uint8_t id, const uint8_t duration);
+
+	/**
+	 * Remove a pose from the library
+	 */
+	void pose_delete(const uint8_t id);
+
+	/**
+	 * Move the hand to a pose. Returns false if the pose has not been saved.
+	 */
+	bool pose_run(const uint8_t id);
+
+	/**
+	 * Return a mask of the valid poses among id to id + 7
+	 */
+	uint8_t pose_list(const uint8_t id);
+
+	/**
+	 * Get a copy of a pose. Returns false if the pose has not been saved.
+	 */
+	bool pose_get(const uint8_t id, struct pose_t* pose);
+#endif
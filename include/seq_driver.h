@@ -0,0 +1,87 @@
+/**
+ * Keyframe sequencer.
+ *
+ * A sequence is a list of keyframes, each one moving the hand to a pose of the
+ * library (see pose_driver.h), optionally changing the mode and the current
+ * limit, and then waiting for its dwell time. The timing comes from the
+ * control loop timer and every keyframe is scheduled relative to the previous
+ * one, so delays in the main loop do not accumulate. The sequence is kept in
+ * RAM and can be saved to EEPROM, where it is loaded from at boot.
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+#ifndef SEQ_DRIVER_H
+#define SEQ_DRIVER_H
+
+	#include <stdbool.h>
+	#include <stddef.h>
+	#include <stdint.h>
+
+	/**
+	 * Configuration directives
+	 */
+	// Maximum number of keyframes of a sequence
+	#define SEQ_LEN  32
+	// Value of mode and current which leaves the setting unchanged
+	#define SEQ_KEEP 0xFF
+
+	struct seq_frame_t
+	{
+		uint8_t pose;    // pose id
+		uint8_t mode;    // WIFI_MODE_* or SEQ_KEEP
+		uint8_t current; // current limit of every finger (mA) or SEQ_KEEP to
+		                 // use the ones of the pose
+		uint8_t dwell;   // time before the next keyframe (WIFI_POSE_TIME_MS)
+	};
+
+	typedef enum { SEQ_STOPPED, SEQ_RUNNING, SEQ_PAUSED } seq_state_t;
+
+	/**
+	 * Load the sequence saved in EEPROM
+	 */
+	void seq_init();
+
+	/**
+	 * Run the keyframes which are due. Must be called from the main loop.
+	 */
+	void seq_poll();
+
+	/**
+	 * Get a pointer to keyframe n for editing, NULL if n is not valid
+	 */
+	struct seq_frame_t* seq_frame(const uint8_t n);
+
+	/**
+	 * Set the number of keyframes of the sequence, at most SEQ_LEN
+	 */
+	void seq_setLength(const uint8_t length);
+
+	/**
+	 * Start the sequence from the first keyframe. If loop is set it restarts
+	 * after the last one until stopped. Returns false, without starting, if
+	 * loop is set and all the keyframes have no dwell: the loop would never
+	 * give the time back to the main loop.
+	 */
+	bool seq_start(const bool loop);
+
+	void seq_stop();
+
+	/**
+	 * Pause or resume the sequence. The motion in progress is completed.
+	 */
+	void seq_pause(const bool pause);
+
+	seq_state_t seq_getState();
+
+	/**
+	 * Index of the next keyframe to be run
+	 */
+	uint8_t seq_getIndex();
+
+	/**
+	 * Save the sequence to EEPROM / load it back
+	 */
+	void seq_save();
+
+	void seq_load();
+#endif
@@ -6,25 +6,38 @@
 #ifndef SERVO_DRIVER_H
 #define SERVO_DRIVER_H
 
+	#include <stdbool.h>
 	#include <stdint.h>
 
 	/**
 	 * Driver operating modes:
 	 *
 	 * ANGLE:  The servo tries to go to the desired angle with a given speed.
+	 *         The motion follows a trapezoidal velocity profile: it
+	 *         accelerates up to that speed and decelerates before the target.
 	 *         If a current threshold is crossed the driving signal is
 	 *         momentarily disabled
 	 *
 	 * HOLD:   The servo tries to hold an object into the hand, applying the
-	 *         desired force. This means that a given angle is kept as long as
-	 *         the current stays below a threshold. If the threshold is crossed
-	 *         the hand is opened slightly.
+	 *         desired force. The current is used as force feedback: a PI
+	 *         regulator closes the finger toward the target angle or opens it
+	 *         until the current settles on the force setpoint. If the current
+	 *         threshold is crossed the hand is opened at once.
 	 *
 	 * FOLLOW: The driver does nothing. It sends pulses to the servo trying to
 	 *         follow the position in which the operator is putting this hand's
 	 *         fingers.
+	 *
+	 * PID:    Like ANGLE, but the position is closed around the angle measured
+	 *         by the feedback potentiometer. The reference moves toward the
+	 *         target with the given speed and a PID controller corrects the
+	 *         difference between the reference and the measured angle.
+	 *
+	 * CALIBRATE: The servo is driven with the compare value chosen by the
+	 *         calibration routine (see calib_driver.h). Only the current
+	 *         threshold is checked.
 	 */
-	typedef enum { ANGLE, HOLD, FOLLOW } servo_state_t;
+	typedef enum { ANGLE, HOLD, FOLLOW, CALIBRATE, PID } servo_state_t;
 
 	/**
 	 * Configuration directives
@@ -36,10 +49,72 @@
 	#define SERVO_PWM_MIN  500
 	// Maximum output value for servo PWM
 	#define SERVO_PWM_MAX  2500
-	// Divider for the speed, used to slow down servo motion
-	#define SPEED_DIVIDER  2
+	// PWM frame rate given by COMPARE_MAX and CLK_DIV
+	#define FRAME_RATE_HZ  50
+	// Rate of the control loop: a multiple of FRAME_RATE_HZ. Current limits,
+	// HOLD regulation and motion profiles run at this rate, the PID still
+	// advances once per PWM frame. The current limits use the last burst of
+	// each servo (ADC_getBurstCurrent()), which with SERVO_STAGGER ends at a
+	// different time of the frame for each servo: at 250 Hz each one is seen
+	// at most 4 ms after its burst instead of at the end of the whole scan
+	#define CONTROL_RATE_HZ 250
+	#define CONTROL_CLK_DIV TC_CLKSEL_DIV64_gc
+	#define CONTROL_PERIOD  (F_CPU / 64 / CONTROL_RATE_HZ - 1)
+	// Spread the servo pulses over the frame instead of starting them all at
+	// the same time, to lower the peak current drawn from the battery. The
+	// index/middle and ring/pinky timers are delayed by the given number of
+	// counts (0 to COMPARE_MAX) and the second channel of each of them is
+	// inverted, so that its pulse is centred half a frame later.
+	#define SERVO_STAGGER  1
+	#define INDEX_TIMER_PHASE ((COMPARE_MAX + 1) / 3)
+	#define RING_TIMER_PHASE  ((COMPARE_MAX + 1) * 2 / 3)
 	// Default maximum current in mA
 	#define DEF_CURRENT_MA 250
+	// Default speed (degrees/s) and maximum acceleration (10 degrees/s^2)
+	#define DEF_SPEED      2
+	#define DEF_ACCEL      10
+	// HOLD mode: speed at which the finger backs off when the current limit
+	// is crossed (degrees/s)
+	#define HOLD_BACKOFF   100
+	// Default force regulation for HOLD mode: current setpoint (mA), PI gains
+	// (Q8.8, degrees per mA and degrees/s per mA), deadband around the
+	// setpoint (mA) and maximum speed of the finger (degrees/s)
+	#define DEF_FORCE_MA   150
+	#define DEF_FORCE_KP   0x0010 // 0.0625
+	#define DEF_FORCE_KI   0x0100 // 1.0
+	#define DEF_FORCE_BAND 5
+	#define DEF_FORCE_RATE 30
+	// Contact and stall detection in ANGLE and PID mode: default flags
+	// (WIFI_EVENTS_* in board.h), current increase in one frame meaning
+	// contact (mA), distance from the reference meaning stall (degrees) and
+	// how long it must last (ms). Off by default: the host enables it with
+	// WIFI_PARAM_EVENTS, so a finger never switches to HOLD on its own
+	#define DEF_EVENTS      0
+	#define DEF_CONTACT_MA  40
+	#define DEF_STALL_DEG   20
+	#define STALL_TIME_MS   200
+	// Idle detach in ANGLE mode: once the reference has reached the target and
+	// the measured angle has stayed within DEF_DETACH_BAND degrees of where it
+	// stopped for DEF_DETACH (100 ms) the pulses stop, they start again when
+	// the finger is pushed DETACH_HYSTERESIS degrees further
+	#define DEF_DETACH        20
+	#define DEF_DETACH_BAND   3
+	#define DETACH_HYSTERESIS 2
+	// Alpha-beta tracker estimating the speed of each finger from its angle
+	// reading, run every control tick. The gains are 1/2^shift.
+	#define TRACK_ALPHA_SHIFT 2
+	#define TRACK_BETA_SHIFT  5
+	// Length of the event queue, see servo_getEvent()
+	#define EVENT_QUEUE_LEN 8
+	// Default PID gains, Q8.8 fixed point. The error is measured in degrees
+	// and the correction in capture-compare units
+	#define DEF_PID_KP     0x0200 // 2.0
+	#define DEF_PID_KI     0x0040 // 0.25
+	#define DEF_PID_KD     0x0080 // 0.5
+	// Limit for the PID integral term (degrees * frames), against windup
+	#define PID_I_MAX      1000
+	// Maximum correction applied by the PID (capture-compare units)
+	#define PID_OUT_MAX    300
 
 	/**
 	 * Initialize the hardware components needed for servo operation
@@ -59,6 +134,13 @@
 	 */
 	void servo_setAngle(const uint8_t servo_num, const uint8_t angle);
 
+	/**
+	 * Move several fingers at once so that they all reach their target angle
+	 * after duration_ms, each one with its own trapezoidal profile. Fingers
+	 * whose angle is 0 are not part of the pose and keep their target.
+	 */
+	void servo_movePose(const uint8_t angles[5], const uint16_t duration_ms);
+
 	/**
 	 * Set the servo current in milliamperes.
 	 * This function fails silently if servo_num is not valid
@@ -66,23 +148,98 @@
 	void servo_setCurrent(const uint8_t servo_num, const uint8_t current_mA);
 
 	/**
-	 * Set the speed at which te servo rotates when in ANGLE mode. This speed is
-	 * a value which will be summed to the current angle until the goal is
-	 * reached.
+	 * Set the speed at which te servo rotates when in ANGLE mode, in degrees per
+	 * second. This is the peak speed of the motion profile.
 	 * This function fails silently if servo_num is not valid
 	 */
 	void servo_setSpeed(const uint8_t servo_num, const uint8_t speed);
 
 	/**
-	 * Return the current speed for the chosen servomotor
+	 * Set a tunable parameter (WIFI_PARAM_* in board.h) of the chosen servo.
+	 * Gains are sent in Q4.4 fixed point.
+	 * This function fails silently if servo_num or param are not valid
+	 */
+	void servo_setParam(const uint8_t servo_num, const uint8_t param,
+			const uint8_t value);
+
+	/**
+	 * Return the value of a tunable parameter, in the same format used by
+	 * servo_setParam(). Unknown parameters read as 0.
+	 *
+	 * NOTE: Choosing an invalid servo number may result in erratic behaviour.
+	 */
+	uint8_t servo_getParam(const uint8_t servo_num, const uint8_t param);
+
+	/**
+	 * Return the measured speed for the chosen servomotor in degrees/s,
+	 * regardless of the direction. Saturates at 255.
 	 *
 	 * NOTE: Choosing an invalid servo number may result in erratic behaviour.
 	 */
 	uint8_t servo_getSpeed(const uint8_t servo_num);
+
+	/**
+	 * Return the measured velocity for the chosen servomotor in degrees/s,
+	 * Q16.16 fixed point, positive while the angle increases.
+	 *
+	 * NOTE: Choosing an invalid servo number may result in erratic behaviour.
+	 */
+	int32_t servo_getVelocity(const uint8_t servo_num);
+
+	/**
+	 * Get the oldest contact or stall event (WIFI_EVENT_* in board.h) of the
+	 * fingers with WIFI_EVENTS_REPORT set. Returns false if the queue is empty.
+	 * Events are dropped when the queue is full.
+	 */
+	bool servo_getEvent(uint8_t* servo_num, uint8_t* event);
+
+	/**
+	 * Number of control loop ticks (CONTROL_RATE_HZ) since boot. Wraps around
+	 * every 65536 ticks, use differences.
+	 */
+	uint16_t servo_getTicks();
+
+	/**
+	 * Get the setpoints of a servo: target angle, speed set with
+	 * servo_setSpeed() and current limit.
+	 */
+	uint8_t servo_getTarget(const uint8_t servo_num);
+
+	uint8_t servo_getMaxSpeed(const uint8_t servo_num);
+
+	uint8_t servo_getMaxCurrent(const uint8_t servo_num);
+
+	/**
+	 * Return the mode a servo is in. It differs from the one chosen with
+	 * servo_setMode() after contact or stall (see WIFI_PARAM_EVENTS) and while
+	 * calibrating.
+	 */
+	servo_state_t servo_getMode(const uint8_t servo_num);
 	/**
 	 * Return the current angle for the chosen servomotor
 	 *
 	 * NOTE: Choosing an invalid servo number may result in erratic behaviour.
 	 */
 	uint8_t servo_getAngle(const uint8_t servo_num);
+
+	/**
+	 * Drive a servo with a raw capture-compare value, bypassing the control
+	 * algorithm. Used by the calibration routine. A value of 0 gives the servo
+	 * back to the current operating mode.
+	 * This function fails silently if servo_num is not valid
+	 */
+	void servo_calibrate(const uint8_t servo_num, const uint16_t comp);
+
+	/**
+	 * Called by the ADC interrupt as soon as the servo current crosses its
+	 * limit. In ANGLE, PID and CALIBRATE mode the pulse is stopped immediately, without waiting
+	 * for the next servo update, and a fault is latched.
+	 */
+	void servo_trip(const uint8_t servo_num);
+
+	/**
+	 * Return a mask of the servos tripped since the last call (bit n set for
+	 * servo n) and clear it.
+	 */
+	uint8_t servo_getFaults();
 #endif
@@ -0,0 +1,54 @@
+/**
+ * Telemetry publisher.
+ *
+ * Once the host subscribes by setting WIFI_PARAM_TELEMETRY, the state of the
+ * whole hand is pushed at the chosen rate as a frame: a header (command
+ * WIFI_TELEMETRY, servo WIFI_TELEMETRY_FRAME, data incremented each frame)
+ * followed by TELEMETRY_WORDS words holding the bytes below, sent in order:
+ *
+ *   0-4   angle of each finger (degrees)
+ *   5-9   current of each finger (mA)
+ *   10-19 velocity of each finger, signed 16 bit little-endian (1/16 deg/s)
+ *   20-24 mode of each finger (WIFI_MODE_*)
+ *   25    battery voltage, see ADC_getBatteryVoltage()
+ *
+ * Angles, currents and battery come from the same ADC frame. The timing comes
+ * from the control loop timer. A frame which does not fit in the transmit
+ * queue is skipped as a whole, the header counter shows the gap. The frames
+ * stop when the connection of the subscriber is closed.
+ * See tests/telemon.c for a host decoding the frames.
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+#ifndef TELEMETRY_DRIVER_H
+#define TELEMETRY_DRIVER_H
+
+	#include <stdint.h>
+
+	/**
+	 * Configuration directives
+	 */
+	// Highest frame rate (Hz), the link can carry a few more
+	#define TELEMETRY_MAX_HZ 100
+	// Size of the frame after the header, in wifiCommand words
+	#define TELEMETRY_WORDS  13
+
+	/**
+	 * Choose the frame rate in Hz, 0 stops the frames, and the wifi connection
+	 * they are sent to (see esp_getLink()). Rates above TELEMETRY_MAX_HZ are
+	 * cropped.
+	 */
+	void telemetry_setRate(const uint8_t rate_hz, const uint8_t link);
+
+	uint8_t telemetry_getRate();
+
+	/**
+	 * Stop the frames if they go to a connection which has been closed.
+	 */
+	void telemetry_close(const uint8_t link);
+
+	/**
+	 * Send a frame if it is due. Called by the main loop.
+	 */
+	void telemetry_poll();
+#endif
@@ -13,6 +13,10 @@
 #define min(a, b) ( ((a) < (b)) ? (a) : (b) )
 #endif
 
+// turn the value of a macro into a string literal
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
 // round a floating point value to the nearest integer
 #define round_uint16(x) ((uint16_t) (x)+0.5)
 #define round_int(x) ((x)>=0?(int)(x)+0.5):(int)((x)-0.5))
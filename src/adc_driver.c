@@ -12,6 +12,10 @@
 #include "include/utils.h"
 #include "include/serio_driver.h"
 
+#include "include/TC_driver.h"
+#include "include/servo_driver.h"
+#include "include/calib_driver.h"
+
 /*
  * The ADC is continuously running. The various channels are scanned one at a
  * time. This data structure keeps track of the conversion.
@@ -20,7 +24,195 @@
  * current of 5 servos plus the battery voltage
  */
 static volatile struct ADC_Conversion_t conv[11];
-static volatile uint8_t convIndex = 0;
+
+// position of each measurement inside conv[]
+#define CURRENT_CONV(_servo) ((_servo) * 2)
+#define ANGLE_CONV(_servo)   (((_servo) * 2) + 1)
+#define BATTERY_CONV         10
+
+/*
+ * Order in which the conversions are performed, built from the schedule found
+ * in board.h. One pass through the table is a frame.
+ *
+ * When ADC_PWM_SYNC is set the sequence is split in bursts by SCAN_WAIT: the
+ * first conversion after it is started by the servo timer through the event
+ * system, using the trigger given in the wait. The first burst starts just
+ * before the centre of the servo pulses, when all of them are high, so it
+ * samples the currents. The second one starts just after the centre and
+ * samples the angles and the battery voltage.
+ * With SERVO_STAGGER the pulses come one at a time: each servo current gets its
+ * own burst, in the order the pulses come in the frame (the thumb at 0 ms, then
+ * index, ring, middle and pinky at 3.3, 6.7, 13.3 and 16.7 ms). The angles and
+ * the battery voltage follow the last one.
+ * In free running mode SCAN_WAIT is simply skipped.
+ */
+#define SCAN_WAIT(_trigger) (0xF0 | (_trigger))
+#define IS_WAIT(_c)         (((_c) & 0xF0) == 0xF0)
+
+// triggers used by SCAN_WAIT, index of scanTrigger[]
+#define THUMB_TRIGGER 0
+#define INDEX_TRIGGER 1 // index and pinky
+#define RING_TRIGGER  2 // ring and middle
+
+static const uint8_t scanTrigger[] = {
+	ADC_TRIGGER_EVENT, ADC_TRIGGER_EVENT_INDEX, ADC_TRIGGER_EVENT_RING
+};
+
+#define REPEAT_1(...) __VA_ARGS__
+#define REPEAT_2(...) __VA_ARGS__, __VA_ARGS__
+#define REPEAT_3(...) __VA_ARGS__, __VA_ARGS__, __VA_ARGS__
+#define REPEAT_4(...) __VA_ARGS__, __VA_ARGS__, __VA_ARGS__, __VA_ARGS__
+#define REPEAT_(_n, ...) REPEAT_##_n(__VA_ARGS__)
+#define REPEAT(_n, ...)  REPEAT_(_n, __VA_ARGS__)
+
+#define CURRENT_SWEEP CURRENT_CONV(THUMB_FINGER), CURRENT_CONV(INDEX_FINGER), \
+	CURRENT_CONV(MIDDLE_FINGER), CURRENT_CONV(RING_FINGER), \
+	CURRENT_CONV(PINKY_FINGER)
+#define ANGLE_SWEEP ANGLE_CONV(THUMB_FINGER), ANGLE_CONV(INDEX_FINGER), \
+	ANGLE_CONV(MIDDLE_FINGER), ANGLE_CONV(RING_FINGER), \
+	ANGLE_CONV(PINKY_FINGER)
+
+#if SERVO_STAGGER
+#define CURRENT_BURST(_servo, _trigger) SCAN_WAIT(_trigger), \
+	REPEAT(ADC_CURRENT_SLOTS, CURRENT_CONV(_servo))
+
+static const uint8_t scanSeq[] = {
+	CURRENT_BURST(THUMB_FINGER, THUMB_TRIGGER),
+	CURRENT_BURST(INDEX_FINGER, INDEX_TRIGGER),
+	CURRENT_BURST(RING_FINGER, RING_TRIGGER),
+	CURRENT_BURST(MIDDLE_FINGER, RING_TRIGGER),
+	CURRENT_BURST(PINKY_FINGER, INDEX_TRIGGER),
+	REPEAT(ADC_ANGLE_SLOTS, ANGLE_SWEEP), BATTERY_CONV
+};
+#else
+static const uint8_t scanSeq[] = {
+	SCAN_WAIT(THUMB_TRIGGER), REPEAT(ADC_CURRENT_SLOTS, CURRENT_SWEEP),
+	SCAN_WAIT(THUMB_TRIGGER), REPEAT(ADC_ANGLE_SLOTS, ANGLE_SWEEP),
+	BATTERY_CONV
+};
+#endif
+#define SCAN_LEN sizeof(scanSeq)
+static volatile uint8_t scanIndex = 0;
+static volatile uint8_t scanFrame = 0; // used to skip the battery slot
+
+/*
+ * Completed frames. frames[front] is the one returned to the consumers while
+ * the other one is filled at the end of the next scan.
+ */
+static volatile struct ADC_Frame_t frames[2];
+static volatile uint8_t front = 0;
+static volatile uint8_t frameSeq = 0;
+
+// overcurrent thresholds (mA) checked on every current sample
+static volatile uint8_t tripCurrent[5] = { 255, 255, 255, 255, 255 };
+
+// highest current of each servo (mA), see ADC_getPeakCurrent()
+static volatile uint8_t servoPeak[5];
+
+// highest current of the last burst of each servo (mA), see
+// ADC_getBurstCurrent()
+static volatile uint8_t burstCurrent[5];
+static uint8_t burstPeak; // of the burst in progress
+
+#if ADC_PWM_SYNC && \
+	(ADC_TRIGGER_COMP + ADC_CURRENT_SLOTS * 5 * ADC_CONV_TICKS >= SERVO_PWM_MIN)
+#error "The current burst does not fit inside the shortest servo pulse"
+#endif
+
+/**
+ * Route the multiplexer to the given conversion
+ */
+static inline void selectConversion(const uint8_t c)
+{
+	ADC_Ch_InputMode_and_Gain_Config(&ADCA.CH0, ADC_CH_INPUTMODE_DIFFWGAIN_gc,
+			conv[c].gain);
+	ADC_Ch_InputMux_Config(&ADCA.CH0, conv[c].muxposPin, ADC_NEG_PIN);
+}
+
+/**
+ * Feed a new sample to the oversampling and filtering stage of a channel
+ */
+static inline void filterSample(volatile struct ADC_Conversion_t* c,
+		const uint16_t sample)
+{
+	c->acc += sample;
+	c->nSamples++;
+	if (c->nSamples < (1 << (2 * c->oversample)))
+		return; // keep summing
+
+	// decimate and left adjust the 11+n bit value to 16 bits
+	uint16_t x = (c->acc >> c->oversample) << (5 - c->oversample);
+	uint16_t y = c->filtered;
+	uint8_t k = c->filter & 0x0F;
+	c->acc = 0;
+	c->nSamples = 0;
+
+	if (c->filter & ADC_FILTER_BOXCAR) {
+		uint32_t sum = 0;
+
+		c->box[c->boxIndex] = x;
+		c->boxIndex = (c->boxIndex + 1) % ADC_BOXCAR_LEN;
+		for (uint8_t i = 0; i < ADC_BOXCAR_LEN; i++)
+			sum += c->box[i];
+
+		y = sum / ADC_BOXCAR_LEN;
+	} else if (c->filter & ADC_FILTER_IIR(0)) {
+		// unsigned arithmetic, take care not to overflow
+		if (x > y)
+			y += (x - y) >> k;
+		else
+			y -= (y - x) >> k;
+	} else {
+		y = x;
+	}
+
+	c->filtered = y;
+}
+
+/**
+ * Fill the back buffer with the current readings and swap it with the front one
+ */
+static inline void publishFrame()
+{
+	volatile struct ADC_Frame_t* back = &frames[front ^ 1];
+
+	for (uint8_t i = 0; i < 5; i++) {
+		back->current[i] = conv[CURRENT_CONV(i)].filtered;
+		back->angle[i] = conv[ANGLE_CONV(i)].filtered;
+	}
+	back->battery = conv[BATTERY_CONV].filtered;
+	back->seq = frameSeq + 1;
+
+	front ^= 1; // single byte write, atomic
+	frameSeq++;
+}
+
+/**
+ * Move scanIndex to the next conversion to be performed, skipping the battery
+ * when it is not its turn. Returns the trigger of the SCAN_WAIT which has been
+ * crossed, or NO_WAIT.
+ */
+#define NO_WAIT 0xFF
+static inline uint8_t advanceScan()
+{
+	uint8_t wait = NO_WAIT;
+	uint8_t c;
+
+	do {
+		scanIndex++;
+		if (scanIndex == SCAN_LEN) {
+			scanIndex = 0;
+			scanFrame = (scanFrame + 1) % ADC_BATTERY_FRAMES;
+			publishFrame();
+		}
+
+		c = scanSeq[scanIndex];
+		if (IS_WAIT(c))
+			wait = c & 0x0F;
+	} while (IS_WAIT(c) || ((c == BATTERY_CONV) && (scanFrame != 0)));
+
+	return wait;
+}
 
 void ADC_init()
 {
@@ -28,7 +220,12 @@ void ADC_init()
 	ADC_ConvMode_and_Resolution_Config(&ADCA, ADC_ConvMode_Signed,
 			ADC_RESOLUTION_12BIT_gc);
 	ADC_Reference_Config(&ADCA, ADC_REFSEL_INT1V_gc);
+#if ADC_PWM_SYNC
+	// a whole burst must fit inside the shortest servo pulse
+	ADC_Prescaler_Config(&ADCA, ADC_PRESCALER_DIV16_gc); // ~9us per conversion
+#else
 	ADC_Prescaler_Config(&ADCA, ADC_PRESCALER_DIV128_gc); // f_samp = 5682Hz
+#endif
 
 	ADC_Ch_Interrupts_Config(&ADCA.CH0, ADC_CH_INTMODE_COMPLETE_gc,
 			ADC_CH_INTLVL_MED_gc);
@@ -37,39 +234,64 @@ void ADC_init()
 	ADC_waitSettle(&ADCA);
 
 	// initialize the conversion struct
-	conv[THUMB_FINGER].muxposPin = THUMB_CURRENT_PIN;
-	conv[THUMB_FINGER].gain = CURRENT_GAIN;
-	conv[THUMB_FINGER + 1].muxposPin = THUMB_ANGLE_PIN;
-	conv[THUMB_FINGER + 1].gain = ANGLE_GAIN;
-
-	conv[INDEX_FINGER * 2].muxposPin = INDEX_CURRENT_PIN;
-	conv[INDEX_FINGER * 2].gain = CURRENT_GAIN;
-	conv[(INDEX_FINGER * 2) + 1].muxposPin = INDEX_ANGLE_PIN;
-	conv[(INDEX_FINGER * 2) + 1].gain = ANGLE_GAIN;
-
-	conv[MIDDLE_FINGER * 2].muxposPin = MIDDLE_CURRENT_PIN;
-	conv[MIDDLE_FINGER * 2].gain = CURRENT_GAIN;
-	conv[(MIDDLE_FINGER * 2) + 1].muxposPin = MIDDLE_ANGLE_PIN;
-	conv[(MIDDLE_FINGER * 2) + 1].gain = ANGLE_GAIN;
-
-	conv[RING_FINGER * 2].muxposPin = RING_CURRENT_PIN;
-	conv[RING_FINGER * 2].gain = CURRENT_GAIN;
-	conv[(RING_FINGER * 2) + 1].muxposPin = RING_ANGLE_PIN;
-	conv[(RING_FINGER * 2) + 1].gain = ANGLE_GAIN;
-
-	conv[PINKY_FINGER * 2].muxposPin = PINKY_CURRENT_PIN;
-	conv[PINKY_FINGER * 2].gain = CURRENT_GAIN;
-	conv[(PINKY_FINGER * 2) + 1].muxposPin = PINKY_ANGLE_PIN;
-	conv[(PINKY_FINGER * 2) + 1].gain = ANGLE_GAIN;
+	conv[CURRENT_CONV(THUMB_FINGER)].muxposPin = THUMB_CURRENT_PIN;
+	conv[CURRENT_CONV(THUMB_FINGER)].gain = CURRENT_GAIN;
+	conv[ANGLE_CONV(THUMB_FINGER)].muxposPin = THUMB_ANGLE_PIN;
+	conv[ANGLE_CONV(THUMB_FINGER)].gain = ANGLE_GAIN;
+
+	conv[CURRENT_CONV(INDEX_FINGER)].muxposPin = INDEX_CURRENT_PIN;
+	conv[CURRENT_CONV(INDEX_FINGER)].gain = CURRENT_GAIN;
+	conv[ANGLE_CONV(INDEX_FINGER)].muxposPin = INDEX_ANGLE_PIN;
+	conv[ANGLE_CONV(INDEX_FINGER)].gain = ANGLE_GAIN;
+
+	conv[CURRENT_CONV(MIDDLE_FINGER)].muxposPin = MIDDLE_CURRENT_PIN;
+	conv[CURRENT_CONV(MIDDLE_FINGER)].gain = CURRENT_GAIN;
+	conv[ANGLE_CONV(MIDDLE_FINGER)].muxposPin = MIDDLE_ANGLE_PIN;
+	conv[ANGLE_CONV(MIDDLE_FINGER)].gain = ANGLE_GAIN;
+
+	conv[CURRENT_CONV(RING_FINGER)].muxposPin = RING_CURRENT_PIN;
+	conv[CURRENT_CONV(RING_FINGER)].gain = CURRENT_GAIN;
+	conv[ANGLE_CONV(RING_FINGER)].muxposPin = RING_ANGLE_PIN;
+	conv[ANGLE_CONV(RING_FINGER)].gain = ANGLE_GAIN;
+
+	conv[CURRENT_CONV(PINKY_FINGER)].muxposPin = PINKY_CURRENT_PIN;
+	conv[CURRENT_CONV(PINKY_FINGER)].gain = CURRENT_GAIN;
+	conv[ANGLE_CONV(PINKY_FINGER)].muxposPin = PINKY_ANGLE_PIN;
+	conv[ANGLE_CONV(PINKY_FINGER)].gain = ANGLE_GAIN;
 
 	// battery voltage
-	conv[10].gain = BATTERY_GAIN;
-	conv[10].muxposPin = ADC_CH_MUXPOS_PIN2_gc;
+	conv[BATTERY_CONV].gain = BATTERY_GAIN;
+	conv[BATTERY_CONV].muxposPin = ADC_CH_MUXPOS_PIN2_gc;
+	conv[BATTERY_CONV].filter = BATTERY_FILTER;
+	conv[BATTERY_CONV].oversample = BATTERY_OVERSAMPLE;
 
-	ADC_Ch_InputMode_and_Gain_Config(&ADCA.CH0, ADC_CH_INPUTMODE_DIFFWGAIN_gc,
-		conv[0].gain);
-	ADC_Ch_InputMux_Config(&ADCA.CH0, conv[0].muxposPin, ADC_NEG_PIN);
+	for (uint8_t i = 0; i < 5; i++) {
+		conv[CURRENT_CONV(i)].filter = CURRENT_FILTER;
+		conv[CURRENT_CONV(i)].oversample = CURRENT_OVERSAMPLE;
+		conv[ANGLE_CONV(i)].filter = ANGLE_FILTER;
+		conv[ANGLE_CONV(i)].oversample = ANGLE_OVERSAMPLE;
+	}
+
+	// skip the leading wait, its trigger starts the first burst
+	uint8_t trigger = THUMB_TRIGGER;
+	while (IS_WAIT(scanSeq[scanIndex]))
+		trigger = scanSeq[scanIndex++] & 0x0F;
+	selectConversion(scanSeq[scanIndex]);
+#if ADC_PWM_SYNC
+	// the servo timer starts the first conversion of each burst
+	adcSetTriggerCompare(ADC_TRIGGER_COMP);
+#if SERVO_STAGGER
+	// counting up the thumb timer meets the index and ring timers at BOTTOM
+	// at their phase, counting down it meets them at TOP
+	adcSetIndexTriggerCompare(INDEX_TIMER_PHASE - ADC_TRIGGER_COMP);
+	adcSetRingTriggerCompare(RING_TIMER_PHASE - ADC_TRIGGER_COMP);
+#endif
+	EVSYS.CH0MUX = scanTrigger[trigger];
+	ADC_Events_Config(&ADCA, ADC_EVSEL_0123_gc, ADC_EVACT_CH0_gc);
+#else
+	(void) trigger;
 	ADC_Ch_Conversion_Start(&ADCA.CH0);
+#endif
 }
 
 ISR(ADCA_CH0_vect)
@@ -78,37 +300,145 @@ ISR(ADCA_CH0_vect)
 	// I'm not interested in the sign of the data
 	int16_t curRes = ADCA.CH0RES;
 
-	conv[convIndex].result = max(0, curRes);
+	uint8_t c = scanSeq[scanIndex];
+	conv[c].result = max(0, curRes);
+	filterSample(&conv[c], conv[c].result);
+
+	bool isCurrent = (c < BATTERY_CONV) && ((c & 0x01) == 0);
+	if (isCurrent) { // current channel
+		uint8_t servo = c / 2;
+		uint8_t mA = ADC_current2mA((uint16_t) conv[c].result << 5);
+
+		servoPeak[servo] = max(servoPeak[servo], mA);
+		burstPeak = max(burstPeak, mA);
+#if ADC_OVERCURRENT_TRIP
+		// fast path protection: do not wait for the servo interrupt
+		uint8_t limit = tripCurrent[servo];
+		if ((limit != 255) && (mA >= limit))
+			servo_trip(servo);
+#endif
+	}
 
 	// prepare the ADC for the next reading
-	convIndex = (convIndex + 1) % 11;
+	uint8_t wait = advanceScan();
+	selectConversion(scanSeq[scanIndex]);
 
-	ADC_Ch_InputMode_and_Gain_Config(&ADCA.CH0, ADC_CH_INPUTMODE_DIFFWGAIN_gc,
-			conv[convIndex].gain);
-	ADC_Ch_InputMux_Config(&ADCA.CH0, conv[convIndex].muxposPin, ADC_NEG_PIN);
+	if (isCurrent && (scanSeq[scanIndex] != c)) { // end of the burst
+		burstCurrent[c / 2] = burstPeak;
+		burstPeak = 0;
+	}
+
+#if ADC_PWM_SYNC
+	if (wait != NO_WAIT) {
+		// the next burst will be started by the servo timer
+		EVSYS.CH0MUX = scanTrigger[wait];
+		return;
+	}
+#else
+	(void) wait;
+#endif
 	ADC_Pipeline_Flush(&ADCA);
 	ADC_Ch_Conversion_Start(&ADCA.CH0);
 }
 
 inline uint8_t ADC_getServoCurrent(uint8_t servo_num)
 {
-	uint16_t tempC = conv[servo_num * 2].result;
-	//tempC = (tempC * 3125) / 3072; // same as 1 (1% rounding error)
-	tempC = min(255, tempC);
-	return (tempC - CURRENT_OFFSET);
+	return ADC_current2mA(ADC_getServoCurrent16(servo_num));
 }
 
 inline uint8_t ADC_getServoAngle(uint8_t servo_num)
 {
-	uint16_t tempA = conv[(servo_num * 2) + 1].result;
-	tempA = (tempA * 9) / 32;
-	tempA = (tempA * 5) / 16;
-	return tempA - ANGLE_OFFSET;
+	return calib_adc2deg(servo_num, ADC_getServoAngle16(servo_num));
 }
 
 inline uint8_t ADC_getBatteryVoltage()
 {
-	return (conv[10].result >> 3); // the sign has no meaning
+	return (ADC_getBatteryVoltage16() >> 8); // the sign has no meaning
+}
+
+void ADC_setTripCurrent(uint8_t servo_num, uint8_t current_mA)
+{
+	if (servo_num > 4)
+		return;
+
+	tripCurrent[servo_num] = current_mA;
+}
+
+uint8_t ADC_getBurstCurrent(uint8_t servo_num)
+{
+	if (servo_num > 4)
+		return 0;
+
+	return burstCurrent[servo_num]; // single byte, atomic
+}
+
+uint8_t ADC_getPeakCurrent(uint8_t servo_num)
+{
+	if (servo_num > 4)
+		return 0;
+
+	return servoPeak[servo_num]; // single byte, atomic
+}
+
+void ADC_resetPeakCurrent(uint8_t servo_num)
+{
+	if (servo_num > 4)
+		return;
+
+	servoPeak[servo_num] = 0;
+}
+
+/*
+ * The single readings are taken from the front frame. The sequence number is
+ * checked to avoid returning a torn 16 bit value.
+ */
+inline uint16_t ADC_getServoCurrent16(uint8_t servo_num)
+{
+	uint8_t seq;
+	uint16_t val;
+
+	do {
+		seq = frameSeq;
+		val = frames[front].current[servo_num];
+	} while (seq != frameSeq);
+
+	return val;
+}
+
+inline uint16_t ADC_getServoAngle16(uint8_t servo_num)
+{
+	uint8_t seq;
+	uint16_t val;
+
+	do {
+		seq = frameSeq;
+		val = frames[front].angle[servo_num];
+	} while (seq != frameSeq);
+
+	return val;
+}
+
+inline uint16_t ADC_getBatteryVoltage16()
+{
+	uint8_t seq;
+	uint16_t val;
+
+	do {
+		seq = frameSeq;
+		val = frames[front].battery;
+	} while (seq != frameSeq);
+
+	return val;
+}
+
+void ADC_getFrame(struct ADC_Frame_t* frame)
+{
+	uint8_t seq;
+
+	do {
+		seq = frameSeq;
+		*frame = frames[front];
+	} while (seq != frameSeq);
 }
 
 /* Prototype for assembly macro. */
@@ -0,0 +1,249 @@
+/**
+ * Implementation for calib_driver.h
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+#include <avr/eeprom.h>
+
+#include "include/board.h"
+#include "include/avr_compiler.h"
+#include "include/adc_driver.h"
+#include "include/servo_driver.h"
+#include "include/fixmath.h"
+#include "include/utils.h"
+
+#include "include/calib_driver.h"
+
+// written to EEPROM together with the tables, to recognize valid data
+#define CALIB_MAGIC 0x7A31
+
+struct calib_table_t
+{
+	uint16_t comp[CALIB_POINTS];     // compare value of each point
+	uint16_t feedback[CALIB_POINTS]; // filtered angle reading of each point
+};
+
+struct calib_data_t
+{
+	uint16_t magic;
+	uint8_t  valid; // bit n is set if servo n has been calibrated
+	struct calib_table_t table[5];
+};
+static struct calib_data_t EEMEM eeCalib;
+
+// time given to the servo to reach each point, in control loop ticks
+#define CALIB_SETTLE_TICKS \
+	((uint32_t) CALIB_SETTLE_MS * CONTROL_RATE_HZ / 1000)
+
+// sweep in progress, see calib_start()
+#define CALIB_IDLE 0xFF
+static uint8_t  sweepServo = CALIB_IDLE; // servo being calibrated
+static uint8_t  sweepPoint = 0;          // point the servo is moving to
+static uint16_t sweepDue = 0;            // tick at which it is read
+static struct calib_table_t sweep;
+
+/*
+ * Lookup tables used at run time. adc2deg is indexed with the 8 most
+ * significant bits of the 16 bit angle reading.
+ */
+static uint16_t deg2comp[5][181];
+static uint8_t  adc2deg[5][256];
+
+/**
+ * Fill the lookup tables of a servo with the nominal conversions
+ */
+static void buildDefault(const uint8_t s)
+{
+	for (uint8_t d = 0; d <= 180; d++)
+		deg2comp[s][d] = fix_deg2comp(d);
+
+	for (uint16_t i = 0; i < 256; i++) {
+		uint8_t deg = fix_adc2deg((i << 8) | 0x80);
+		// the offset would make the lowest readings wrap around
+		deg = (deg > ANGLE_OFFSET) ? (deg - ANGLE_OFFSET) : 0;
+		adc2deg[s][i] = min(deg, 180);
+	}
+}
+
+/**
+ * Fill the lookup tables of a servo from its calibration table. Divisions are
+ * fine here since this runs only at boot or after a calibration.
+ */
+static void buildCalibrated(const uint8_t s, const struct calib_table_t* t)
+{
+	uint16_t fbMin = t->feedback[0];
+	uint16_t fbMax = t->feedback[CALIB_POINTS - 1];
+
+	// the potentiometer is linear: scale its range to 0-180 degrees
+	for (uint16_t i = 0; i < 256; i++) {
+		uint16_t fb = (i << 8) | 0x80;
+
+		if (fb <= fbMin)
+			adc2deg[s][i] = 0;
+		else if (fb >= fbMax)
+			adc2deg[s][i] = 180;
+		else
+			adc2deg[s][i] = ((uint32_t) (fb - fbMin) * 180) / (fbMax - fbMin);
+	}
+
+	// look for the feedback value of each angle and interpolate the compare
+	// value between the two nearest points of the sweep
+	uint8_t k = 0;
+	for (uint8_t d = 0; d <= 180; d++) {
+		uint16_t fb = fbMin + ((uint32_t) (fbMax - fbMin) * d) / 180;
+
+		while ((k < CALIB_POINTS - 2) && (fb > t->feedback[k + 1]))
+			k++;
+
+		uint16_t f0 = t->feedback[k];
+		uint16_t f1 = t->feedback[k + 1];
+		uint16_t c0 = t->comp[k];
+		uint16_t c1 = t->comp[k + 1];
+		deg2comp[s][d] = c0 + ((uint32_t) (fb - f0) * (c1 - c0)) / (f1 - f0);
+	}
+}
+
+void calib_init()
+{
+	struct calib_data_t data;
+	eeprom_read_block(&data, &eeCalib, sizeof(data));
+
+	if (data.magic != CALIB_MAGIC)
+		data.valid = 0; // blank EEPROM
+
+	for (uint8_t i = 0; i < 5; i++) {
+		if (data.valid & (1 << i))
+			buildCalibrated(i, &data.table[i]);
+		else
+			buildDefault(i);
+	}
+}
+
+/**
+ * Drive the servo being calibrated to a point of the sweep
+ */
+static void movePoint(const uint8_t k)
+{
+	sweep.comp[k] = SERVO_PWM_MIN +
+		((uint32_t) k * (SERVO_PWM_MAX - SERVO_PWM_MIN)) / (CALIB_POINTS - 1);
+	servo_calibrate(sweepServo, sweep.comp[k]);
+	sweepDue += CALIB_SETTLE_TICKS;
+}
+
+/**
+ * Check a finished sweep and store it. Returns false if the feedback did not
+ * follow the sweep.
+ */
+static bool storeSweep(const uint8_t servo_num, const struct calib_table_t* t)
+{
+	// the feedback must follow the sweep, always increasing
+	for (uint8_t k = 1; k < CALIB_POINTS; k++) {
+		if (t->feedback[k] < t->feedback[k - 1] + (CALIB_MIN_STEP << 5)) {
+			servo_calibrate(servo_num, 0); // release the finger
+			return false;
+		}
+	}
+
+	// store the new table, keeping the ones of the other servos
+	uint16_t magic = eeprom_read_word(&eeCalib.magic);
+	uint8_t valid = eeprom_read_byte(&eeCalib.valid);
+	if (magic != CALIB_MAGIC)
+		valid = 0;
+
+	eeprom_update_block(t, &eeCalib.table[servo_num], sizeof(*t));
+	eeprom_update_byte(&eeCalib.valid, valid | (1 << servo_num));
+	eeprom_update_word(&eeCalib.magic, CALIB_MAGIC);
+
+	buildCalibrated(servo_num, t);
+	servo_calibrate(servo_num, 0); // release the finger
+	return true;
+}
+
+bool calib_start(const uint8_t servo_num)
+{
+	if ((servo_num > 4) || (sweepServo != CALIB_IDLE))
+		return false;
+
+	sweepServo = servo_num;
+	sweepPoint = 0;
+	sweepDue = servo_getTicks() + CALIB_SETTLE_TICKS; // the finger may start
+	movePoint(0);                                     // from the other end
+	return true;
+}
+
+bool calib_poll(bool* success)
+{
+	if ((sweepServo == CALIB_IDLE)
+			|| ((int16_t) (servo_getTicks() - sweepDue) < 0))
+		return false;
+
+	sweep.feedback[sweepPoint] = ADC_getServoAngle16(sweepServo);
+	if (++sweepPoint < CALIB_POINTS) {
+		movePoint(sweepPoint);
+		return false;
+	}
+
+	*success = storeSweep(sweepServo, &sweep);
+	sweepServo = CALIB_IDLE;
+	return true;
+}
+
+bool calib_isRunning()
+{
+	return sweepServo != CALIB_IDLE;
+}
+
+inline uint16_t calib_deg2comp(const uint8_t servo_num, const uint8_t angle)
+{
+	return deg2comp[servo_num][min(angle, 180)];
+}
+
+uint16_t calib_deg2compQ8(const uint8_t servo_num, const uint16_t angle)
+{
+	uint8_t deg = min(angle >> 8, 180);
+	uint16_t comp = deg2comp[servo_num][deg];
+
+	if (deg < 180) {
+		uint16_t step = deg2comp[servo_num][deg + 1] - comp;
+		comp += ((uint32_t) step * (angle & 0xFF)) >> 8;
+	}
+
+	return comp;
+}
+
+uint8_t calib_comp2deg(const uint8_t servo_num, const uint16_t comp)
+{
+	// deg2comp is increasing: binary search the nearest angle below comp
+	uint8_t lo = 0, hi = 180;
+
+	while (lo < hi) {
+		uint8_t mid = (lo + hi + 1) / 2;
+
+		if (deg2comp[servo_num][mid] <= comp)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+inline uint8_t calib_adc2deg(const uint8_t servo_num, const uint16_t angle16)
+{
+	return adc2deg[servo_num][angle16 >> 8];
+}
+
+uint16_t calib_adc2degQ8(const uint8_t servo_num, const uint16_t angle16)
+{
+	// each entry is the angle at the centre of its step
+	uint16_t x = (angle16 > 0x80) ? (angle16 - 0x80) : 0;
+	uint8_t i = x >> 8;
+	uint16_t deg = adc2deg[servo_num][i] << 8;
+
+	if (i < 255) {
+		int16_t step = (int16_t) adc2deg[servo_num][i + 1] - adc2deg[servo_num][i];
+		deg += ((int32_t) step * (x & 0xFF));
+	}
+
+	return deg;
+}
@@ -10,6 +10,8 @@
 // optimized out by the compiler
 struct CommandQueue {
 	union wifiCommand cmd[COMMAND_QUEUE_SIZE];
+	uint8_t link[COMMAND_QUEUE_SIZE]; // connection the command comes from or
+	                                  // goes to
 	uint8_t next; // index of the next element in the array
 	uint8_t nQueued; // nomber of enqueued items
 };
@@ -18,24 +20,69 @@ static volatile struct CommandQueue txCmds, rxCmds;
 // parser status
 static esp_state_t pStatus = BEGIN;
 
+// connection of the last command returned by esp_getCommand()
+static uint8_t lastLink = 0;
+
+// mask of the connections closed since the last esp_getClosed()
+static volatile uint8_t closedLinks = 0;
+
 /**
  * Command transmission is done in two steps.
- * In the first one CMD_SEND is sent through the serial port. This enables the
- * transmission.
- * In the second step the actual data is sent. The command is two byte wide so
- * we have to keep count of how many bytes have been sent.
+ * In the first one "AT+CIPSEND=l,n" is sent through the serial port, l being
+ * the connection and n the size of a whole batch of commands for it. This
+ * enables the transmission. If the ESP answers ERROR instead of '>', e.g. the
+ * connection has been closed, the batch is dropped.
+ * In the second step the actual data is sent. Each command is two byte wide so
+ * we have to keep count of how many bytes have been sent. The next batch waits
+ * for the "SEND OK" (or "SEND FAIL") of this one, the ESP answers "busy s..."
+ * to anything sent before. esp_poll() drops a batch the ESP never answers.
  * The following variables make such functionality possible.
  */
-const static char* CMD_SEND = "AT+CIPSEND=0,2\r\n";
+#if !ESP_UDP
+static char cmdSend[20]; // AT+CIPSEND string of the current batch
+#endif
 static volatile uint8_t initCount = 0;   // index within the string above
 static volatile uint8_t cmdCount = 0;    // index within the command
+static volatile uint8_t txBatch = 0;     // commands left in the current batch
+static volatile bool    txFlush = false; // send the queued commands
 static volatile bool    canSend = false; // is the device ready to receive our data?
+static volatile bool    txDrop = false;  // the ESP refused the batch
+static volatile bool    txBusy = false;  // waiting for SEND OK or SEND FAIL
+static volatile uint8_t txEvents = 0;    // counts the steps of the batches
 
 /**
  * Send a C string through the serial port
  */
 void transmitStr(char* data);
 
+#if !ESP_UDP
+/**
+ * Fill cmdSend for a batch of n commands to a connection
+ */
+static void buildSend(const uint8_t link, const uint8_t n)
+{
+	const char* prefix = "AT+CIPSEND=";
+	uint8_t len = 2 * n;
+	uint8_t i = 0;
+
+	while (*prefix != 0)
+		cmdSend[i++] = *prefix++;
+
+	cmdSend[i++] = link + 48;
+	cmdSend[i++] = ',';
+
+	if (len >= 100)
+		cmdSend[i++] = len / 100 + 48;
+	if (len >= 10)
+		cmdSend[i++] = (len / 10) % 10 + 48;
+	cmdSend[i++] = len % 10 + 48;
+
+	cmdSend[i++] = '\r';
+	cmdSend[i++] = '\n';
+	cmdSend[i] = 0;
+}
+#endif
+
 /**
  * Initialization routine
  */
@@ -58,11 +105,26 @@ void esp_init()
 	_delay_ms(10);
 	transmitStr("AT+CWSAP=\"Thing\",\"\",5,0\r\n");
 	_delay_ms(10);
+#if ESP_UDP
+	transmitStr("AT+CIPMUX=0\r\n");
+	_delay_ms(10);
+	// mode 2: the remote end becomes the sender of the last datagram
+	transmitStr("AT+CIPSTART=\"UDP\",\"192.168.4.255\","
+		STR(ESP_UDP_PORT) "," STR(ESP_UDP_PORT) ",2\r\n");
+	_delay_ms(100);
+	transmitStr("AT+CIPMODE=1\r\n");
+	_delay_ms(10);
+	transmitStr("AT+CIPSEND\r\n"); // from now on only raw data
+	_delay_ms(10);
+	while (USART_IsRXComplete(&ESP_USART)) // drop the last answers
+		USART_GetChar(&ESP_USART);
+#else
 	transmitStr("AT+CIPMUX=1\r\n");
 	_delay_ms(10);
 	transmitStr("AT+CIPSERVER=1\r\n"); // default port = 333
 	//_delay_ms(10);
 	//transmitStr("AT+CIPSTO=60\r\n"); // client activity timeout
+#endif
 
 	// initialize an empty command Queue
 	txCmds.next = 0;
@@ -76,45 +138,116 @@ void esp_init()
 
 ISR(ESP_USART_RXC_vect)
 {
-	static uint8_t skipCount; // number of characters to be skipped
-	static uint8_t dataLen;   // length of the received packet
-
 	char in = USART_GetChar(&ESP_USART);
 
+#if ESP_UDP
+	// transparent mode: nothing but command frames, see ESP_UDP_SYNC
+	static uint8_t high, low; // bytes of the command being received
+
+	switch (pStatus) {
+		case FETCH_HIGH:
+			high = in;
+			pStatus = FETCH_LOW;
+			break;
+
+		case FETCH_LOW:
+			low = in;
+			pStatus = FETCH_CHECK;
+			break;
+
+		case FETCH_CHECK:
+			if ((uint8_t) in == ESP_UDP_CHECK(high, low)) {
+				rxCmds.cmd[rxCmds.next].raw = ((uint16_t) high << 8) | low;
+
+				rxCmds.next = (rxCmds.next + 1) % COMMAND_QUEUE_SIZE;
+				if (rxCmds.nQueued < COMMAND_QUEUE_SIZE)
+					rxCmds.nQueued++;
+			}
+			pStatus = BEGIN; // out of sync otherwise, look for the next frame
+			break;
+
+		default:
+			if ((uint8_t) in == ESP_UDP_SYNC)
+				pStatus = FETCH_HIGH;
+			break;
+	}
+#else
+	static uint8_t  skipCount; // number of characters to be skipped
+	static uint16_t dataLen;   // bytes of the packet still to be received
+	static uint8_t  link;      // connection the packet comes from
+	static uint32_t tail;      // last four characters out of the packets
+	static uint8_t  msgLink;   // last digit out of the packets, l in l,CLOSED
+
 	switch (pStatus) {
 		case BEGIN:
-			if (in == '+') {
-				skipCount = 6;  // when data is received the ESP sends:
-				pStatus = SKIP_TO_LENGTH; // +IPD,0,n:<data>
-				                // so skip to the number of bits n
+			if ((in >= '0') && (in <= '9')) {
+				msgLink = in - 48;
+			} else if (in == '+') {
+				skipCount = 4;  // when data is received the ESP sends:
+				pStatus = SKIP_TO_LINK; // +IPD,l,n:<data>
+				                // so skip to the connection l
 			} else if (in == '>') {
-				canSend = true;
+				canSend = true; // go on with the batch
+				txEvents++;
+				USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_HI_gc);
+			}
+
+			tail = (tail << 8) | (uint8_t) in;
+			if (tail == 0x52524F52UL) { // "RROR": AT+CIPSEND for a
+				txDrop = true;          // connection which is gone
+				txBusy = false;
+				txEvents++;
+				USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_HI_gc);
+			} else if ((tail == 0x44204F4BUL) || (tail == 0x4641494CUL)) {
+				txBusy = false; // "D OK" or "FAIL": the batch is over
+				txEvents++;
+				USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_HI_gc);
+			} else if ((tail == 0x4F534544UL) && (msgLink < 8)) {
+				closedLinks |= 1 << msgLink; // "OSED": the client is gone
 			}
 			break;
 
-		case SKIP_TO_LENGTH:
+		case SKIP_TO_LINK:
 			skipCount--;
-			if (skipCount == 0)
-				pStatus = COMPUTE_LEN;
+			if (skipCount == 0) {
+				link = 0;
+				pStatus = READ_LINK;
+			}
 			break;
 
-		case COMPUTE_LEN: // see 'man ascii' for details about conversion
-			dataLen = min(in - 48, 8); // up to 8 bits at a time
-			pStatus = SKIP_TO_DATA;
+		case READ_LINK:
+			if ((in >= '0') && (in <= '9')) {
+				link = in - 48;
+			} else if (in == ',') {
+				dataLen = 0;
+				pStatus = COMPUTE_LEN;
+			} else {
+				pStatus = BEGIN;
+			}
 			break;
 
-		case SKIP_TO_DATA:
-			// just discard one char
-			pStatus = FETCH_HIGH;
+		case COMPUTE_LEN: // see 'man ascii' for details about conversion
+			if ((in >= '0') && (in <= '9')) {
+				dataLen = dataLen * 10 + (in - 48);
+			} else if ((in == ':') && (dataLen > 0)) {
+				pStatus = FETCH_HIGH; // the whole batch follows
+			} else {
+				pStatus = BEGIN; // not a data packet
+			}
 			break;
 
 		case FETCH_HIGH:
-			rxCmds.cmd[rxCmds.next].raw = in << 8; // set the high byte
+			if (dataLen == 1) { // odd byte, not a command
+				pStatus = BEGIN;
+				break;
+			}
+			rxCmds.cmd[rxCmds.next].raw = (uint8_t) in << 8; // set the high byte
 			pStatus = FETCH_LOW;
 			break;
 
 		case FETCH_LOW:
-			rxCmds.cmd[rxCmds.next].raw |= in; // set the low byte
+			rxCmds.cmd[rxCmds.next].raw |= (uint8_t) in; // set the low byte
+			rxCmds.link[rxCmds.next] = link;
 
 			rxCmds.next = (rxCmds.next + 1) % COMMAND_QUEUE_SIZE;
 			if (rxCmds.nQueued < COMMAND_QUEUE_SIZE)
@@ -126,35 +259,93 @@ ISR(ESP_USART_RXC_vect)
 			else
 				pStatus = FETCH_HIGH;
 			break;
+
+		default: // FETCH_CHECK is for transparent mode only
+			pStatus = BEGIN;
+			break;
 	}
+#endif
 }
 
 ISR(ESP_USART_DRE_vect)
 {
+#if ESP_UDP
+	// transparent mode: the ESP8266 makes the datagrams, no AT+CIPSEND
 	if (txCmds.nQueued == 0) {
-		// nothing to do. Stop
 		USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_OFF_gc);
-	} else {
-		char ch = *(CMD_SEND + initCount);
-
-		if (ch != 0) {
-			ESP_USART.DATA = ch;
-			++initCount;
-		} else if (canSend == true) { // string ended and device ready
-			uint8_t index = mod(txCmds.next - txCmds.nQueued,
-						COMMAND_QUEUE_SIZE);
-			char* cmd_ptr = (char*) &txCmds.cmd[index];
-			ch = *(cmd_ptr + cmdCount);
-			ESP_USART.DATA = ch;
-
-			cmdCount = (cmdCount + 1) % 2;
-			if (cmdCount == 0) {
-				--txCmds.nQueued;
+		return;
+	}
+
+	uint8_t index = mod(txCmds.next - txCmds.nQueued, COMMAND_QUEUE_SIZE);
+	uint8_t* cmd_ptr = (uint8_t*) &txCmds.cmd[index];
+
+	if (cmdCount == 0) // frame: sync, the two bytes, check
+		ESP_USART.DATA = ESP_UDP_SYNC;
+	else if (cmdCount < 3)
+		ESP_USART.DATA = *(cmd_ptr + cmdCount - 1);
+	else
+		ESP_USART.DATA = ESP_UDP_CHECK(cmd_ptr[0], cmd_ptr[1]);
+
+	cmdCount = (cmdCount + 1) % 4;
+	if (cmdCount == 0)
+		--txCmds.nQueued;
+#else
+	if (txBatch == 0) { // start a new batch
+		if (txBusy) {
+			// the last one is still on its way, the receiver starts us again
+			USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_OFF_gc);
+			return;
+		}
+		if (!txFlush || (txCmds.nQueued == 0)) {
+			// nothing to do. Stop
+			txFlush = false;
+			USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_OFF_gc);
+			return;
+		}
+
+		// as many commands as possible for the same connection
+		uint8_t first = mod(txCmds.next - txCmds.nQueued, COMMAND_QUEUE_SIZE);
+		uint8_t link = txCmds.link[first];
+		uint8_t n = 1;
+		while ((n < min(txCmds.nQueued, ESP_TX_BATCH))
+				&& (txCmds.link[(first + n) % COMMAND_QUEUE_SIZE] == link))
+			n++;
+
+		txBatch = n;
+		buildSend(link, n);
+		initCount = 0;
+		txDrop = false;
+	}
+
+	char ch = cmdSend[initCount];
+
+	if (ch != 0) {
+		ESP_USART.DATA = ch;
+		++initCount;
+	} else if (canSend == true) { // string ended and device ready
+		uint8_t index = mod(txCmds.next - txCmds.nQueued,
+					COMMAND_QUEUE_SIZE);
+		char* cmd_ptr = (char*) &txCmds.cmd[index];
+		ch = *(cmd_ptr + cmdCount);
+		ESP_USART.DATA = ch;
+
+		cmdCount = (cmdCount + 1) % 2;
+		if (cmdCount == 0) {
+			--txCmds.nQueued;
+			if (--txBatch == 0) { // batch done, a new '>' is needed
 				canSend = false;
-				initCount = 0;
+				txBusy = true;
 			}
 		}
+	} else if (txDrop == true) { // refused, go on with the next batch
+		txCmds.nQueued -= txBatch;
+		txBatch = 0;
+		txDrop = false;
+	} else {
+		// wait for '>', the receiver starts us again
+		USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_OFF_gc);
 	}
+#endif
 }
 
 void transmitStr(char* data)
@@ -172,25 +363,108 @@ union wifiCommand esp_getCommand(const bool blocking)
 	// wait until there's at least one command stored in the queue
 	while ((blocking == true) && (rxCmds.nQueued == 0)) {;}
 
-	// dequeue the oldest element
+	// dequeue the oldest element, the receiver may be adding new ones
+	AVR_ENTER_CRITICAL_REGION();
 	uint8_t index = mod(rxCmds.next - rxCmds.nQueued, COMMAND_QUEUE_SIZE);
 	if (rxCmds.nQueued > 0)
 		rxCmds.nQueued--;
 
-	return rxCmds.cmd[index];
+	union wifiCommand cmd = rxCmds.cmd[index];
+	lastLink = rxCmds.link[index];
+	AVR_LEAVE_CRITICAL_REGION();
+
+	return cmd;
+}
+
+bool esp_hasCommand()
+{
+	return (rxCmds.nQueued > 0);
+}
+
+bool esp_isReceiving()
+{
+	return !ESP_UDP && (pStatus != BEGIN);
+}
+
+uint8_t esp_getLink()
+{
+	return lastLink;
+}
+
+uint8_t esp_getClosed()
+{
+	AVR_ENTER_CRITICAL_REGION();
+	uint8_t closed = closedLinks;
+	closedLinks = 0;
+	AVR_LEAVE_CRITICAL_REGION();
+
+	return closed;
 }
 
 void esp_sendCommand(const union wifiCommand cmd)
 {
-	// stop interrupts when modifying the data structures
-	USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_OFF_gc);
+	esp_sendCommandTo(cmd, lastLink);
+}
 
-	txCmds.cmd[txCmds.next] = cmd;
-	txCmds.next = (txCmds.next + 1) % COMMAND_QUEUE_SIZE;
+void esp_sendCommandTo(const union wifiCommand cmd, const uint8_t link)
+{
+	// stop interrupts when modifying the data structures
+	AVR_ENTER_CRITICAL_REGION();
 
-	if (txCmds.nQueued < COMMAND_QUEUE_SIZE) // discard old data
+	// the oldest commands may be part of the batch being sent, keep them
+	if (txCmds.nQueued < COMMAND_QUEUE_SIZE) {
+		txCmds.cmd[txCmds.next] = cmd;
+		txCmds.link[txCmds.next] = link;
+		txCmds.next = (txCmds.next + 1) % COMMAND_QUEUE_SIZE;
 		txCmds.nQueued++;
+	}
 
-	// ready to send the data out
-	USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_HI_gc);
+	// a full batch is ready, or no batches at all in transparent mode
+	if (ESP_UDP || (txCmds.nQueued - txBatch >= ESP_TX_BATCH)) {
+		txFlush = true;
+		USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_HI_gc);
+	}
+
+	AVR_LEAVE_CRITICAL_REGION();
+}
+
+uint8_t esp_txFree()
+{
+	return COMMAND_QUEUE_SIZE - txCmds.nQueued;
+}
+
+void esp_flush()
+{
+	AVR_ENTER_CRITICAL_REGION();
+	if (txCmds.nQueued > 0) {
+		txFlush = true;
+		USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_HI_gc);
+	}
+	AVR_LEAVE_CRITICAL_REGION();
+}
+
+void esp_poll(const uint16_t now)
+{
+#if !ESP_UDP
+	static uint16_t since;  // time of the last step of a batch
+	static uint8_t  events; // txEvents at that time
+
+	AVR_ENTER_CRITICAL_REGION();
+	bool waiting = txBusy || ((txBatch > 0) && !canSend);
+	if ((events != txEvents) || !waiting) {
+		events = txEvents;
+		since = now;
+	} else if ((uint16_t) (now - since) >= ESP_TX_TIMEOUT_MS) {
+		// no '>', ERROR or SEND OK: give up on the batch
+		if (!txBusy)
+			txCmds.nQueued -= txBatch;
+		txBatch = 0;
+		txBusy = false;
+		canSend = false; // a late '>' must not start the next one
+		initCount = 0;
+		since = now;
+		USART_DreInterruptLevel_Set(&ESP_USART, USART_DREINTLVL_HI_gc);
+	}
+	AVR_LEAVE_CRITICAL_REGION();
+#endif
 }
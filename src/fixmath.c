@@ -0,0 +1,41 @@
+/**
+ * Implementation for fixmath.h
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+#include "include/fixmath.h"
+
+// same as SERVO_PWM_MIN + ((angle * 25) / 9) * 4, computed by the compiler
+#define DEG2COMP(_a) (SERVO_PWM_MIN + (((_a) * 25) / 9) * 4)
+#define DEG2COMP_10(_a) DEG2COMP(_a), DEG2COMP(_a + 1), DEG2COMP(_a + 2), \
+	DEG2COMP(_a + 3), DEG2COMP(_a + 4), DEG2COMP(_a + 5), DEG2COMP(_a + 6), \
+	DEG2COMP(_a + 7), DEG2COMP(_a + 8), DEG2COMP(_a + 9)
+
+const uint16_t deg2compTable[181] PROGMEM = {
+	DEG2COMP_10(0),   DEG2COMP_10(10),  DEG2COMP_10(20),  DEG2COMP_10(30),
+	DEG2COMP_10(40),  DEG2COMP_10(50),  DEG2COMP_10(60),  DEG2COMP_10(70),
+	DEG2COMP_10(80),  DEG2COMP_10(90),  DEG2COMP_10(100), DEG2COMP_10(110),
+	DEG2COMP_10(120), DEG2COMP_10(130), DEG2COMP_10(140), DEG2COMP_10(150),
+	DEG2COMP_10(160), DEG2COMP_10(170), DEG2COMP(180)
+};
+
+uint16_t fix_sqrt(uint32_t x)
+{
+	uint32_t root = 0;
+	uint32_t bit = 1UL << 30;
+
+	while (bit > x)
+		bit >>= 2;
+
+	while (bit != 0) {
+		if (x >= root + bit) {
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return root;
+}
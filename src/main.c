@@ -13,6 +13,10 @@
 #include "include/serio_driver.h"
 #include "include/servo_driver.h"
 #include "include/battery_driver.h"
+#include "include/calib_driver.h"
+#include "include/pose_driver.h"
+#include "include/seq_driver.h"
+#include "include/telemetry_driver.h"
 
 /**
  * Firmware entry point
@@ -30,6 +34,9 @@ int main( void )
 
 	ADC_init();
 	servo_init();
+	calib_init();
+	pose_init();
+	seq_init();
 	battery_init();
 	serio_init();
 	esp_init();
@@ -42,8 +49,71 @@ int main( void )
 	/*
 	 * main loop: listens for comands and executes them
 	 */
+	uint8_t faultLog = 0; // faults not yet read by the host
+	uint8_t param = WIFI_PARAM_KP; // parameter used by WIFI_SET/GET_PARAM
+	uint8_t pose[5] = { 0, 0, 0, 0, 0 }; // angles for WIFI_MOVE_POSE
+	uint8_t poseTime = 0; // duration used by WIFI_POSE_SAVE
+	struct seq_frame_t* frame = seq_frame(0); // edited by WIFI_SEQ
+	uint16_t lastCmd = 0; // tick of the last command, see ESP_COALESCE_MS
+	uint8_t eventLink = ESP_NO_LINK; // client which set WIFI_EVENTS_REPORT
+	union wifiCommand calibCmd;      // WIFI_CALIBRATE being run
+	uint8_t calibLink = 0;           // and the client waiting for it
 	while (1) {
+		uint8_t faults = servo_getFaults();
+		if (faults != 0) { // report overcurrent trips as soon as possible
+			const char* hex = "0123456789ABCDEF";
+			serio_putString("F");
+			serio_putChar(hex[faults >> 4]); // mask of the tripped servos
+			serio_putChar(hex[faults & 0x0F]);
+			serio_putString("\r\n");
+			faultLog |= faults;
+		}
+
+		uint8_t closed = esp_getClosed();
+		for (uint8_t link = 0; closed != 0; link++, closed >>= 1) {
+			if (!(closed & 0x01))
+				continue;
+			telemetry_close(link); // nobody is listening any more
+			if (link == eventLink)
+				eventLink = ESP_NO_LINK;
+		}
+
+		seq_poll();
+		telemetry_poll();
+
+		bool calibrated;
+		if (calib_poll(&calibrated)) { // the sweep is over
+			calibCmd.field.data = calibrated;
+			esp_sendCommandTo(calibCmd, calibLink);
+		}
+		esp_poll(servo_getTicks() * (1000 / CONTROL_RATE_HZ));
+
+		uint8_t servo, event;
+		while (servo_getEvent(&servo, &event)) { // push contact and stall
+			union wifiCommand ev;
+			ev.field.command = WIFI_EVENT;
+			ev.field.servo = servo;
+			ev.field.data = event;
+			if (eventLink != ESP_NO_LINK)
+				esp_sendCommandTo(ev, eventLink);
+
+			serio_putString("E");
+			serio_putChar(servo + 48);
+			serio_putChar(event + 48);
+			serio_putString("\r\n");
+		}
+
+		if (!esp_hasCommand()) {
+			// the whole packet has been executed: send all the replies
+			// with one AT+CIPSEND
+			if (!esp_isReceiving() || ((uint16_t) (servo_getTicks()
+					- lastCmd) >= ESP_COALESCE_MS * CONTROL_RATE_HZ / 1000))
+				esp_flush();
+			continue;
+		}
+
 		union wifiCommand cmd = esp_getCommand(true);
+		lastCmd = servo_getTicks();
 
 		serio_putChar('C');
 		serio_putChar(cmd.field.command + 48);
@@ -67,6 +137,9 @@ int main( void )
 				} else if (cmd.field.data == WIFI_MODE_HOLD) {
 					servo_setMode(HOLD);
 					esp_sendCommand(cmd);
+				} else if (cmd.field.data == WIFI_MODE_PID) {
+					servo_setMode(PID);
+					esp_sendCommand(cmd);
 				}
 				break;
 
@@ -99,6 +172,132 @@ int main( void )
 				cmd.field.data = servo_getSpeed(cmd.field.servo);
 				esp_sendCommand(cmd);
 				break;
+
+			case WIFI_GET_FAULT:
+				cmd.field.data = faultLog | servo_getFaults();
+				faultLog = 0;
+				esp_sendCommand(cmd);
+				break;
+
+			case WIFI_CALIBRATE: // answered when the sweep is over
+				if ((seq_getState() == SEQ_STOPPED)
+						&& calib_start(cmd.field.servo)) {
+					calibCmd = cmd;
+					calibLink = esp_getLink();
+				} else {
+					cmd.field.data = 0;
+					esp_sendCommand(cmd);
+				}
+				break;
+
+			case WIFI_SEL_PARAM:
+				param = cmd.field.data;
+				esp_sendCommand(cmd);
+				break;
+
+			case WIFI_SET_PARAM:
+				if (param == WIFI_PARAM_TELEMETRY) {
+					telemetry_setRate(cmd.field.data, esp_getLink());
+					cmd.field.data = telemetry_getRate();
+				} else {
+					servo_setParam(cmd.field.servo, param, cmd.field.data);
+					if ((param == WIFI_PARAM_EVENTS)
+							&& (cmd.field.data & WIFI_EVENTS_REPORT))
+						eventLink = esp_getLink(); // events go to this client
+				}
+				esp_sendCommand(cmd);
+				break;
+
+			case WIFI_GET_PARAM:
+				if (param == WIFI_PARAM_TELEMETRY)
+					cmd.field.data = telemetry_getRate();
+				else
+					cmd.field.data = servo_getParam(cmd.field.servo, param);
+				esp_sendCommand(cmd);
+				break;
+
+			case WIFI_MOVE_POSE:
+				if (cmd.field.servo < 5) {
+					pose[cmd.field.servo] = cmd.field.data;
+				} else if (cmd.field.servo == WIFI_POSE_GO) {
+					servo_movePose(pose,
+						(uint16_t) cmd.field.data * WIFI_POSE_TIME_MS);
+					for (uint8_t i = 0; i < 5; i++)
+						pose[i] = 0; // the next pose starts from scratch
+				}
+				esp_sendCommand(cmd);
+				break;
+
+			case WIFI_POSE:
+				if (cmd.field.servo == WIFI_POSE_RUN) {
+					cmd.field.data = pose_run(cmd.field.data);
+				} else if (cmd.field.servo == WIFI_POSE_SAVE) {
+					cmd.field.data = pose_save(cmd.field.data, poseTime);
+				} else if (cmd.field.servo == WIFI_POSE_DELETE) {
+					pose_delete(cmd.field.data);
+				} else if (cmd.field.servo == WIFI_POSE_LIST) {
+					cmd.field.data = pose_list(cmd.field.data);
+				} else if (cmd.field.servo == WIFI_POSE_TIME) {
+					poseTime = cmd.field.data;
+				}
+				esp_sendCommand(cmd);
+				break;
+
+			case WIFI_SEQ:
+				switch (cmd.field.servo) {
+					case WIFI_SEQ_SELECT:
+						if (seq_frame(cmd.field.data) != NULL)
+							frame = seq_frame(cmd.field.data);
+						break;
+
+					case WIFI_SEQ_POSE:
+						frame->pose = cmd.field.data;
+						break;
+
+					case WIFI_SEQ_MODE:
+						frame->mode = cmd.field.data;
+						break;
+
+					case WIFI_SEQ_CURRENT:
+						frame->current = cmd.field.data;
+						break;
+
+					case WIFI_SEQ_DWELL:
+						frame->dwell = cmd.field.data;
+						break;
+
+					case WIFI_SEQ_LENGTH:
+						seq_setLength(cmd.field.data);
+						break;
+
+					case WIFI_SEQ_START: // a sweep would be spoiled
+						if (calib_isRunning()
+								|| !seq_start(cmd.field.data != 0))
+							cmd.field.data = WIFI_SEQ_REFUSED;
+						break;
+
+					case WIFI_SEQ_STOP:
+						seq_stop();
+						break;
+
+					case WIFI_SEQ_PAUSE:
+						seq_pause(cmd.field.data != 0);
+						break;
+
+					case WIFI_SEQ_SAVE:
+						seq_save();
+						break;
+
+					case WIFI_SEQ_LOAD:
+						seq_load();
+						break;
+
+					case WIFI_SEQ_STATUS:
+						cmd.field.data = (seq_getState() << 6) | seq_getIndex();
+						break;
+				}
+				esp_sendCommand(cmd);
+				break;
 		}
 	}
 }
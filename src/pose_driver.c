@@ -0,0 +1,112 @@
+/**
+ * Implementation for pose_driver.h
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+#include <avr/eeprom.h>
+
+#include "include/board.h"
+#include "include/avr_compiler.h"
+#include "include/servo_driver.h"
+
+#include "include/pose_driver.h"
+
+// written to EEPROM together with the poses, to recognize valid data
+#define POSE_MAGIC 0x7A32
+
+struct pose_data_t
+{
+	uint16_t magic;
+	uint16_t valid; // bit n is set if pose n has been saved
+	struct pose_t pose[POSE_COUNT];
+};
+static struct pose_data_t EEMEM eePoses;
+
+static struct pose_data_t poses; // RAM copy of the library
+
+void pose_init()
+{
+	eeprom_read_block(&poses, &eePoses, sizeof(poses));
+
+	if (poses.magic != POSE_MAGIC) {
+		poses.magic = POSE_MAGIC; // blank EEPROM
+		poses.valid = 0;
+	}
+}
+
+/**
+ * Write the valid mask to EEPROM, with the magic number the first time
+ */
+static void saveValid()
+{
+	eeprom_update_word(&eePoses.valid, poses.valid);
+	eeprom_update_word(&eePoses.magic, POSE_MAGIC);
+}
+
+bool pose_save(const uint8_t id, const uint8_t duration)
+{
+	if (id >= POSE_COUNT)
+		return false;
+
+	struct pose_t* p = &poses.pose[id];
+	for (uint8_t i = 0; i < 5; i++) {
+		p->angle[i] = servo_getTarget(i);
+		p->speed[i] = servo_getMaxSpeed(i);
+		p->current[i] = servo_getMaxCurrent(i);
+	}
+	p->duration = duration;
+
+	eeprom_update_block(p, &eePoses.pose[id], sizeof(*p));
+	poses.valid |= (1U << id);
+	saveValid();
+
+	return true;
+}
+
+void pose_delete(const uint8_t id)
+{
+	if (id >= POSE_COUNT)
+		return;
+
+	poses.valid &= ~(1U << id);
+	saveValid();
+}
+
+bool pose_run(const uint8_t id)
+{
+	if ((id >= POSE_COUNT) || !(poses.valid & (1U << id)))
+		return false;
+
+	const struct pose_t* p = &poses.pose[id];
+	for (uint8_t i = 0; i < 5; i++) {
+		if (p->angle[i] == 0)
+			continue; // not part of the pose
+
+		servo_setCurrent(i, p->current[i]);
+		servo_setSpeed(i, p->speed[i]);
+		if (p->duration == 0)
+			servo_setAngle(i, p->angle[i]);
+	}
+
+	if (p->duration != 0)
+		servo_movePose(p->angle, (uint16_t) p->duration * WIFI_POSE_TIME_MS);
+
+	return true;
+}
+
+uint8_t pose_list(const uint8_t id)
+{
+	if (id >= POSE_COUNT)
+		return 0;
+
+	return (poses.valid >> id) & 0xFF;
+}
+
+bool pose_get(const uint8_t id, struct pose_t* pose)
+{
+	if ((id >= POSE_COUNT) || !(poses.valid & (1U << id)))
+		return false;
+
+	*pose = poses.pose[id];
+	return true;
+}
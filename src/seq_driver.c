@@ -0,0 +1,170 @@
+/**
+ * Implementation for seq_driver.h
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+#include <stddef.h>
+#include <avr/eeprom.h>
+
+#include "include/board.h"
+#include "include/servo_driver.h"
+#include "include/pose_driver.h"
+#include "include/utils.h"
+
+#include "include/seq_driver.h"
+
+// written to EEPROM together with the sequence, to recognize valid data
+#define SEQ_MAGIC 0x7A33
+
+struct seq_data_t
+{
+	uint16_t magic;
+	uint8_t  length;
+	struct seq_frame_t frame[SEQ_LEN];
+};
+static struct seq_data_t EEMEM eeSeq;
+
+static struct seq_data_t seq; // sequence being edited and run
+
+static seq_state_t state = SEQ_STOPPED;
+static bool    looping = false;
+static uint8_t next = 0;      // next keyframe
+static uint16_t due = 0;      // tick at which the next keyframe is run
+static uint16_t remaining = 0; // ticks left when paused
+
+void seq_init()
+{
+	seq_load();
+}
+
+/**
+ * Apply a keyframe and schedule the next one
+ */
+static void runFrame(const struct seq_frame_t* f)
+{
+	switch (f->mode) {
+		case WIFI_MODE_FOLLOW:
+			servo_setMode(FOLLOW);
+			break;
+
+		case WIFI_MODE_ANGLE:
+			servo_setMode(ANGLE);
+			break;
+
+		case WIFI_MODE_HOLD:
+			servo_setMode(HOLD);
+			break;
+
+		case WIFI_MODE_PID:
+			servo_setMode(PID);
+			break;
+	}
+
+	pose_run(f->pose); // poses which have not been saved are skipped
+
+	if (f->current != SEQ_KEEP) {
+		for (uint8_t i = 0; i < 5; i++)
+			servo_setCurrent(i, f->current);
+	}
+
+	// relative to the previous due time, not to now: no drift
+	due += ((uint32_t) f->dwell * WIFI_POSE_TIME_MS * CONTROL_RATE_HZ) / 1000;
+}
+
+void seq_poll()
+{
+	if (state != SEQ_RUNNING)
+		return;
+
+	bool wrapped = false; // at most one pass per call, whatever the dwells
+
+	// due is never more than a dwell time ahead, fits in 15 bits
+	while ((int16_t) (servo_getTicks() - due) >= 0) {
+		if (next >= seq.length) {
+			if (!looping || (seq.length == 0)) {
+				state = SEQ_STOPPED;
+				return;
+			}
+			if (wrapped)
+				return; // the rest at the next call
+			next = 0;
+			wrapped = true;
+		}
+
+		runFrame(&seq.frame[next]);
+		next++;
+	}
+}
+
+struct seq_frame_t* seq_frame(const uint8_t n)
+{
+	if (n >= SEQ_LEN)
+		return NULL;
+
+	return &seq.frame[n];
+}
+
+void seq_setLength(const uint8_t length)
+{
+	seq.length = min(length, SEQ_LEN);
+}
+
+bool seq_start(const bool loop)
+{
+	if (loop) {
+		uint16_t dwell = 0;
+		for (uint8_t i = 0; i < seq.length; i++)
+			dwell += seq.frame[i].dwell;
+		if (dwell == 0)
+			return false;
+	}
+
+	looping = loop;
+	next = 0;
+	due = servo_getTicks();
+	state = SEQ_RUNNING;
+	seq_poll(); // the first keyframe right now
+	return true;
+}
+
+void seq_stop()
+{
+	state = SEQ_STOPPED;
+}
+
+void seq_pause(const bool pause)
+{
+	if (pause && (state == SEQ_RUNNING)) {
+		int16_t left = due - servo_getTicks();
+		remaining = max(left, 0);
+		state = SEQ_PAUSED;
+	} else if (!pause && (state == SEQ_PAUSED)) {
+		due = servo_getTicks() + remaining;
+		state = SEQ_RUNNING;
+	}
+}
+
+seq_state_t seq_getState()
+{
+	return state;
+}
+
+uint8_t seq_getIndex()
+{
+	return next;
+}
+
+void seq_save()
+{
+	seq.magic = SEQ_MAGIC;
+	eeprom_update_block(&seq, &eeSeq, sizeof(seq));
+}
+
+void seq_load()
+{
+	state = SEQ_STOPPED;
+	eeprom_read_block(&seq, &eeSeq, sizeof(seq));
+
+	if ((seq.magic != SEQ_MAGIC) || (seq.length > SEQ_LEN))
+		seq.length = 0; // blank EEPROM
+}
@@ -7,6 +7,8 @@
 #include "include/avr_compiler.h"
 #include "include/TC_driver.h"
 #include "include/adc_driver.h"
+#include "include/calib_driver.h"
+#include "include/fixmath.h"
 
 #include "include/servo_driver.h"
 #include "include/serio_driver.h"
@@ -14,150 +16,777 @@
 
 static volatile servo_state_t status = FOLLOW; // start in a safe mode
 
+/**
+ * Positions are angles in Q16.16 fixed point degrees, speeds are in position
+ * units per control loop tick. Even the slowest speed (1 degree/s) moves the
+ * position by a few hundred units per tick, so the motion stays smooth.
+ */
+#define DEG2POS(_deg)  ((uint32_t) (_deg) << 16)
+#define POS2DEG(_pos)  ((uint8_t) (((_pos) + 0x8000) >> 16))
+#define POS2DEGQ8(_pos) ((uint16_t) (((_pos) + 0x80) >> 8))
+// degrees/s -> position units per tick
+#define DPS2VEL(_dps)  (((uint32_t) (_dps) << 16) / CONTROL_RATE_HZ)
+// same as DPS2VEL, cheaper for variables
+#define VEL_SCALE      ((1UL << 16) / CONTROL_RATE_HZ)
+// 10 degrees/s^2 -> position units per tick^2
+#define ACCEL2TICK(_a) (((uint32_t) (_a) * 10 << 16) \
+		/ ((uint32_t) CONTROL_RATE_HZ * CONTROL_RATE_HZ))
+
+/**
+ * Trapezoidal velocity profile, precomputed by planMotion() or planTimed() and
+ * evaluated once per control loop tick by trajStep().
+ *
+ * The motion accelerates for accEnd ticks up to the peak speed
+ * (accEnd * accel), keeps it until cruiseEnd, covers the remainder of the
+ * distance in one more tick and then decelerates until end. Timed motions
+ * spread the remainder over the cruise ticks instead, to end in time.
+ */
+struct trajectory_t
+{
+	uint16_t tick;      // ticks since the start of the motion
+	uint16_t accEnd;    // last tick of the acceleration
+	uint16_t cruiseEnd; // last tick at peak speed
+	uint16_t restTick;  // tick covering the remainder, 0 if none
+	uint16_t end;       // last tick of the motion
+	uint32_t vel;       // current speed
+	uint32_t rest;      // remainder of the distance
+	uint32_t spread;    // added to each cruise step
+	uint16_t spreadRem; // cruise ticks with one more unit
+	uint32_t target;    // final position
+	uint32_t accel;
+	bool     up;        // direction of the motion
+};
+
 struct servo_data_t
 {
 	servo_state_t status;
-	uint16_t controlPWM; // Value to send to the CC module, multiplied by
-	                     // SPEED_DIVIDER to get fractional speed
+	uint32_t position; // reference angle, mapped to the compare value only
+	                   // when the output is written
+	uint16_t calibComp; // compare value imposed by servo_calibrate()
 	uint8_t  maxCurrent_mA; // maximum allowed current
 	uint8_t  targetAngle_deg; // angle to be reached
-	uint8_t  speed; // speed of angle rotation
+	uint8_t  speed; // peak speed of the motion (degrees/s)
+	uint8_t  accel; // maximum acceleration (10 degrees/s^2)
+	uint32_t vmax;  // speed and accel in position units, see DPS2VEL
+	uint32_t amax;
+	struct trajectory_t traj;
+	// PID controller, gains are Q8.8
+	uint16_t kp, ki, kd;
+	int16_t  integral; // sum of the errors (degrees)
+	uint8_t  lastAngle; // measured angle at the previous update
+	int16_t  correction; // last PID output, held between PID updates
+	// HOLD force regulation, gains are Q8.8
+	uint8_t  force_mA; // current setpoint
+	uint16_t fkp, fki;
+	uint8_t  forceBand; // deadband (mA)
+	uint8_t  forceRate; // maximum speed (degrees/s)
+	int16_t  lastForceError;
+	// contact and stall detection
+	uint8_t  eventFlags; // WIFI_EVENTS_*
+	uint8_t  contact_mA; // current increase in one frame
+	uint8_t  stall_deg;  // distance from the reference
+	uint8_t  lastCurrent; // current at the previous frame
+	uint16_t stallTicks; // ticks spent far from the reference
+	bool     eventLatched; // an event has been raised for this motion
+	// idle detach in ANGLE mode, see idleUpdate()
+	uint8_t  detachTime; // settle time (100 ms), 0 disables it
+	uint8_t  detachBand; // distance from the target (degrees)
+	uint16_t idleTicks;  // ticks spent settled
+	uint8_t  restAngle;  // measured angle the finger settles around
+	bool     detached;   // pulses stopped
+	// speed estimation, see trackAngle()
+	int32_t  estAngle; // degrees, Q16.16
+	int32_t  estVel;   // degrees per control tick, Q16.16
+	bool     estValid; // the tracker has seen a reading
 };
 static struct servo_data_t sData[5];
 
+/**
+ * Compare registers of a servo. Writing them through pointers lets the same
+ * code update every finger, whatever its timer and channel.
+ */
+struct servo_output_t
+{
+	register16_t* ccBuf; // buffered compare value, loaded at BOTTOM
+	register16_t* cc;    // compare value in use
+	register8_t*  ctrlB; // holds the output enable bit
+	uint8_t       enable; // CCxEN bit of the channel
+	bool          inverted; // pulse centred on TOP instead of BOTTOM
+};
+static const struct servo_output_t outputs[5] = {
+	[THUMB_FINGER]  = THUMB_OUTPUT,
+	[INDEX_FINGER]  = INDEX_OUTPUT,
+	[MIDDLE_FINGER] = MIDDLE_OUTPUT,
+	[RING_FINGER]   = RING_OUTPUT,
+	[PINKY_FINGER]  = PINKY_OUTPUT
+};
+
+/**
+ * Compare value giving a pulse of the requested width. The timers run in dual
+ * slope mode: the output is high while the count is below the compare value,
+ * so the pulse is centred on BOTTOM. Inverting the pin and the compare value
+ * moves the pulse on TOP, width 0 gives a value above TOP (always low).
+ */
+static inline uint16_t pulse2comp(const struct servo_output_t* o,
+		const uint16_t width)
+{
+	return o->inverted ? (COMPARE_MAX + 1 - width) : width;
+}
+
+// compare values computed by the control loop, latched at TOP by the timers
+static volatile uint16_t pending[5];
+// control loop ticks since the start of the PWM frame
+static uint8_t controlTick = 0;
+// control loop ticks since boot, see servo_getTicks()
+static volatile uint16_t tickCount = 0;
+
+#if (CONTROL_RATE_HZ % FRAME_RATE_HZ) != 0
+#error "CONTROL_RATE_HZ must be a multiple of FRAME_RATE_HZ"
+#endif
+
+// contact and stall events, (servo << 4) | event
+static volatile uint8_t eventQueue[EVENT_QUEUE_LEN];
+static volatile uint8_t eventHead = 0; // next to be read
+static volatile uint8_t eventTail = 0; // next to be written
+
+// servos whose output has been cut by servo_trip() and has to be restored
+static volatile uint8_t tripped = 0;
+// latched faults, cleared by servo_getFaults()
+static volatile uint8_t faults = 0;
+
 void servo_init()
 {
 	PORTD.DIRSET = PIN0_bm;
 	PORTC.DIRSET = PIN5_bm | PIN4_bm | PIN1_bm | PIN0_bm;
+#if SERVO_STAGGER
+	// middle and pinky outputs are inverted (see pulse2comp). Their pins are
+	// set high, so that they stay low when disconnected from the timer
+	PORTC.OUTSET = PIN4_bm | PIN0_bm;
+	PORTC.PIN4CTRL = PORT_INVEN_bm;
+	PORTC.PIN0CTRL = PORT_INVEN_bm;
+#endif
+	for (int i = 0; i < 5; i++) { // no pulse until the first update
+		*outputs[i].cc = pulse2comp(&outputs[i], 0);
+		*outputs[i].ccBuf = pulse2comp(&outputs[i], 0);
+		pending[i] = pulse2comp(&outputs[i], 0);
+	}
 
 	TC_SetPeriod(&THUMB_TIMER, COMPARE_MAX);
-	TC0_ConfigClockSource(&THUMB_TIMER, CLK_DIV);
 	TC0_ConfigWGM(&THUMB_TIMER, TC_WGMODE_DS_T_gc);
 	TC0_EnableCCChannels(&THUMB_TIMER, TC0_CCAEN_bm);
-	TC0_SetCCAIntLevel(&THUMB_TIMER, TC_CCAINTLVL_MED_gc);
+	TC0_SetOverflowIntLevel(&THUMB_TIMER, TC_OVFINTLVL_MED_gc);
 
 	TC_SetPeriod(&INDEX_TIMER, COMPARE_MAX);
-	TC1_ConfigClockSource(&INDEX_TIMER, CLK_DIV);
 	TC1_ConfigWGM(&INDEX_TIMER, TC_WGMODE_DS_T_gc);
 	TC1_EnableCCChannels(&INDEX_TIMER, TC0_CCBEN_bm);
 	TC1_EnableCCChannels(&MIDDLE_TIMER, TC0_CCAEN_bm); // on the same timer
+	TC1_SetOverflowIntLevel(&INDEX_TIMER, TC_OVFINTLVL_MED_gc);
 
 	TC_SetPeriod(&RING_TIMER, COMPARE_MAX);
-	TC0_ConfigClockSource(&RING_TIMER, CLK_DIV);
 	TC0_ConfigWGM(&RING_TIMER, TC_WGMODE_DS_T_gc);
 	TC0_EnableCCChannels(&RING_TIMER, TC0_CCBEN_bm);
 	TC0_EnableCCChannels(&PINKY_TIMER, TC0_CCAEN_bm); // on the same timer
+	TC0_SetOverflowIntLevel(&RING_TIMER, TC_OVFINTLVL_MED_gc);
+
+#if SERVO_STAGGER
+	// counting down from the phase, these timers reach BOTTOM (the centre of
+	// the non inverted pulses) phase counts after the thumb one
+	TC_SetCount(&INDEX_TIMER, INDEX_TIMER_PHASE);
+	INDEX_TIMER.CTRLFSET = TC1_DIR_bm;
+	TC_SetCount(&RING_TIMER, RING_TIMER_PHASE);
+	RING_TIMER.CTRLFSET = TC0_DIR_bm;
+#endif
+	// start the timers together to keep their phase
+	TC0_ConfigClockSource(&THUMB_TIMER, CLK_DIV);
+	TC1_ConfigClockSource(&INDEX_TIMER, CLK_DIV);
+	TC0_ConfigClockSource(&RING_TIMER, CLK_DIV);
+
+	// the control loop runs on its own, the PWM timers only latch its output
+	TC_SetPeriod(&CONTROL_TIMER, CONTROL_PERIOD);
+	TC1_ConfigWGM(&CONTROL_TIMER, TC_WGMODE_NORMAL_gc);
+	TC1_SetOverflowIntLevel(&CONTROL_TIMER, TC_OVFINTLVL_MED_gc);
+	TC1_ConfigClockSource(&CONTROL_TIMER, CONTROL_CLK_DIV);
 
 	// provide some safe default values
 	for (int i = 0; i < 5; i++) {
 		sData[i].status = FOLLOW;
-		sData[i].controlPWM = SERVO_PWM_MIN * SPEED_DIVIDER;
+		sData[i].position = 0;
 		sData[i].targetAngle_deg = 0;
 		sData[i].maxCurrent_mA = DEF_CURRENT_MA;
-		sData[i].speed = 1;
+		sData[i].speed = DEF_SPEED;
+		sData[i].accel = DEF_ACCEL;
+		sData[i].vmax = DPS2VEL(DEF_SPEED);
+		sData[i].amax = ACCEL2TICK(DEF_ACCEL);
+		sData[i].traj.end = 0;
+		sData[i].traj.tick = 0;
+		sData[i].kp = DEF_PID_KP;
+		sData[i].ki = DEF_PID_KI;
+		sData[i].kd = DEF_PID_KD;
+		sData[i].integral = 0;
+		sData[i].correction = 0;
+		sData[i].force_mA = DEF_FORCE_MA;
+		sData[i].fkp = DEF_FORCE_KP;
+		sData[i].fki = DEF_FORCE_KI;
+		sData[i].forceBand = DEF_FORCE_BAND;
+		sData[i].forceRate = DEF_FORCE_RATE;
+		sData[i].lastForceError = 0;
+		sData[i].eventFlags = DEF_EVENTS;
+		sData[i].contact_mA = DEF_CONTACT_MA;
+		sData[i].stall_deg = DEF_STALL_DEG;
+		sData[i].lastCurrent = 0;
+		sData[i].stallTicks = 0;
+		sData[i].eventLatched = false;
+		sData[i].detachTime = DEF_DETACH;
+		sData[i].detachBand = DEF_DETACH_BAND;
+		sData[i].idleTicks = 0;
+		sData[i].restAngle = 0;
+		sData[i].detached = false;
+		sData[i].estAngle = 0;
+		sData[i].estVel = 0;
+		sData[i].estValid = false;
+		ADC_setTripCurrent(i, DEF_CURRENT_MA);
 	}
 }
+
 /**
- * Convert an angle in degrees into a valid capture-compare value
+ * Plan a new motion from the current position to the target angle. Called from
+ * the main loop, so the plan is built with interrupts disabled.
  */
-inline uint16_t angle2comp(uint8_t angle)
+static void planMotion(const uint8_t servo_num)
 {
-	return SERVO_PWM_MIN + ((angle * 25) / 9) * 4; // (MAX-MIN) / 180
+	struct servo_data_t* sd = &sData[servo_num];
+	struct trajectory_t* tr = &sd->traj;
+	uint32_t vmax = sd->vmax;
+	uint32_t a = min(sd->amax, vmax); // at least one tick of acceleration
+
+	AVR_ENTER_CRITICAL_REGION();
+	uint32_t pos = sd->position;
+	uint32_t target = DEG2POS(sd->targetAngle_deg);
+	uint32_t dist = (target > pos) ? (target - pos) : (pos - target);
+
+	sd->eventLatched = false; // a new motion, look for events again
+	sd->detached = false;
+	sd->idleTicks = 0;
+	tr->tick = 0;
+	tr->vel = 0;
+	tr->target = target;
+	tr->up = (target > pos);
+	tr->accel = a;
+	tr->spread = 0;
+	tr->spreadRem = 0;
+
+	if ((a == 0) || (dist == 0)) {
+		tr->end = 0; // nothing to do
+	} else {
+		// n ticks of acceleration and n - 1 of deceleration cover a * n^2.
+		// The peak speed n * a can not exceed vmax
+		uint16_t n = fix_sqrt(dist / a);
+		n = min(n, vmax / a);
+
+		uint32_t left = dist - a * n * n;
+		uint32_t m = (n > 0) ? (left / (n * a)) : 0; // ticks at peak speed
+
+		tr->rest = left - m * n * a;
+		tr->accEnd = n;
+		tr->cruiseEnd = n + m;
+		tr->restTick = (tr->rest != 0) ? (tr->cruiseEnd + 1) : 0;
+		tr->end = tr->cruiseEnd + ((tr->rest != 0) ? 1 : 0)
+			+ ((n > 0) ? (n - 1) : 0);
+	}
+	AVR_LEAVE_CRITICAL_REGION();
 }
 
 /**
- * Interrupt service routine. It transfers the requested servo angle to the PWM
- * subsystem, checking that the current does not exceed the threshold.
- *
- * TODO: maybe one for each servo group?
- */
-ISR(TCD0_CCA_vect)
-{
-	for (int i = 0; i < 5; i++)
-	{ // update the driving signal for each servo
-		uint16_t compVal = sData[i].controlPWM;
-		uint16_t targetComp = angle2comp(sData[i].targetAngle_deg)
-			* SPEED_DIVIDER;
-		uint8_t speed = sData[i].speed;
-		uint8_t maxCurrent = sData[i].maxCurrent_mA;
-		uint8_t actualAngle = ADC_getServoAngle(i);
-		uint8_t actualCurrent = ADC_getServoCurrent(i);
-
-		switch (sData[i].status)
-		{
-			case ANGLE:
-				if (actualCurrent < maxCurrent) {
-					if (compVal < targetComp) {
-						compVal += speed;
-						compVal = min(compVal, targetComp);
-					} else if (compVal > targetComp) {
-						compVal -= speed;
-						compVal = max(compVal, targetComp);
-					}
-				} else {
-					compVal = 0; // too much current. STOP!
-				}
-				break;
+ * Plan a motion to the target angle lasting exactly ticks. A quarter of the
+ * time is spent accelerating and a quarter decelerating. Must be called with
+ * interrupts disabled.
+ */
+static void planTimed(const uint8_t servo_num, const uint16_t ticks)
+{
+	struct servo_data_t* sd = &sData[servo_num];
+	struct trajectory_t* tr = &sd->traj;
+	uint32_t pos = sd->position;
+	uint32_t target = DEG2POS(sd->targetAngle_deg);
+	uint32_t dist = (target > pos) ? (target - pos) : (pos - target);
 
-			case HOLD:
-				// NOTE: I'm supposing the hand is closed when the servo goes
-				// to 180 degrees and opened otherwhise
-				if (actualCurrent < maxCurrent) {
-					compVal++; // hold it slowly, yum!
-					compVal = min(compVal, targetComp);
-				} else {
-					compVal -= 10;
-					compVal = max(compVal, SERVO_PWM_MIN * SPEED_DIVIDER);
-				}
-				break;
+	uint16_t n = ticks / 4;
+	uint16_t m = (n > 0) ? (ticks - 2 * n + 1) : ticks; // end == ticks
+	uint32_t area = (uint32_t) n * n + (uint32_t) m * n; // distance / accel
+	uint32_t a = (area != 0) ? (dist / area) : 0;
+	uint32_t left = dist - a * area;
 
-			case FOLLOW:
-				if ((compVal == 0) && (actualCurrent < 5))
-				{ // compVal was zero so the current is negligible and the angle
-				  // reading correct
-					compVal = angle2comp(actualAngle) * SPEED_DIVIDER;
-				} else {
-					compVal = 0;
-				}
-				break;
-		}
+	sd->eventLatched = false;
+	sd->detached = false;
+	sd->idleTicks = 0;
+	tr->tick = 0;
+	tr->vel = 0;
+	tr->target = target;
+	tr->up = (target > pos);
+	tr->accel = a;
+	tr->rest = 0;
+	tr->restTick = 0;
+	tr->spread = left / m;
+	tr->spreadRem = left % m;
+	tr->accEnd = n;
+	tr->cruiseEnd = n + m;
+	tr->end = (dist != 0) ? ticks : 0;
+}
+
+/**
+ * Evaluate the profile for the next tick and return the new position
+ */
+static uint32_t trajStep(struct trajectory_t* tr, uint32_t pos)
+{
+	uint32_t d;
 
-		if (compVal >= SERVO_PWM_MIN * SPEED_DIVIDER) // save only if valid
-			sData[i].controlPWM = compVal;
+	tr->tick++;
+	if (tr->tick <= tr->accEnd) {
+		tr->vel += tr->accel;
+		d = tr->vel;
+	} else if (tr->tick <= tr->cruiseEnd) {
+		d = tr->vel + tr->spread;
+		if (tr->tick - tr->accEnd <= tr->spreadRem)
+			d++;
+	} else if (tr->tick == tr->restTick) {
+		d = tr->rest;
+	} else {
+		tr->vel -= tr->accel;
+		d = tr->vel;
+	}
 
-		// set the capture-compare value to the correct servo
-		compVal = compVal / SPEED_DIVIDER;
-		switch (i) {
-			case THUMB_FINGER:
-				thumbSetCompare(compVal);
-				break;
+	if (tr->tick == tr->end)
+		return tr->target; // exact, whatever happened in between
 
-			case INDEX_FINGER:
-				indexSetCompare(compVal);
-				break;
+	return tr->up ? (pos + d) : (pos - d);
+}
 
-			case MIDDLE_FINGER:
-				middleSetCompare(compVal);
-				break;
+/**
+ * Move pos toward target by at most step
+ */
+static inline uint32_t moveToward(uint32_t pos, const uint32_t target,
+		const uint32_t step)
+{
+	if (pos < target)
+		pos = (target - pos > step) ? (pos + step) : target;
+	else if (pos > target)
+		pos = (pos - target > step) ? (pos - step) : target;
 
-			case RING_FINGER:
-				ringSetCompare(compVal);
-				break;
+	return pos;
+}
 
-			case PINKY_FINGER:
-				pinkySetCompare(compVal);
-				break;
+/**
+ * Move the reference position of ANGLE and PID mode toward the target. The
+ * planned profile is followed, if the position has been changed by something
+ * else a constant speed ramp is used instead.
+ */
+static uint32_t moveReference(struct servo_data_t* sd, uint32_t pos,
+		const uint32_t target)
+{
+	struct trajectory_t* tr = &sd->traj;
+
+	if ((tr->tick < tr->end) && (tr->target == target))
+		return trajStep(tr, pos);
+
+	return moveToward(pos, target, sd->vmax);
+}
+
+/**
+ * Compute the PID correction, in capture-compare units, for a servo whose
+ * reference is at refAngle while its measured position is actualAngle.
+ * The integral term is frozen when the output saturates (anti-windup) and the
+ * derivative is taken on the measure, so that reference changes do not kick.
+ */
+static int16_t pidUpdate(struct servo_data_t* sd, const uint8_t refAngle,
+		const uint8_t actualAngle)
+{
+	int16_t error = (int16_t) refAngle - actualAngle;
+	int16_t deriv = (int16_t) sd->lastAngle - actualAngle;
+	int16_t integral = sd->integral + error;
+	sd->lastAngle = actualAngle;
+
+	integral = max(integral, -PID_I_MAX);
+	integral = min(integral, PID_I_MAX);
+
+	int32_t out = (int32_t) sd->kp * error + (int32_t) sd->ki * integral
+		+ (int32_t) sd->kd * deriv;
+	out /= 256; // Q8.8 -> integer
+
+	// the correction can not take the output out of the servo range
+	int16_t refComp = calib_deg2comp(sd - sData, refAngle);
+	int16_t outMax = min(PID_OUT_MAX, SERVO_PWM_MAX - refComp);
+	int16_t outMin = max(-PID_OUT_MAX, SERVO_PWM_MIN - refComp);
+
+	if (out > outMax) {
+		out = outMax;
+	} else if (out < outMin) {
+		out = outMin;
+	} else {
+		sd->integral = integral; // integrate only when not saturated
+	}
+
+	return out;
+}
+
+/**
+ * Force regulation of HOLD mode, run every tick. The current is the force
+ * feedback and the output is the movement of the position reference, so this
+ * is a PI controller in velocity form:
+ *     du = kp * (e - e_prev) + ki * e * dt
+ * which needs no integral state and can not wind up. The finger closes toward
+ * the target angle and opens toward 0. Returns the new position.
+ */
+static uint32_t forceUpdate(struct servo_data_t* sd, uint32_t pos,
+		const uint32_t target, const uint8_t current)
+{
+	int16_t error = (int16_t) sd->force_mA - current;
+	if ((error <= sd->forceBand) && (error >= -sd->forceBand))
+		error = 0; // close enough, stay still
+
+	// Q8.8 degrees -> position units: << 8. Q8.8 degrees/s -> position
+	// units per tick: * VEL_SCALE >> 8
+	int32_t du = ((int32_t) sd->fkp * (error - sd->lastForceError)) << 8;
+	du += ((int32_t) sd->fki * error * (int32_t) VEL_SCALE) >> 8;
+	sd->lastForceError = error;
+
+	int32_t duMax = (int32_t) sd->forceRate * VEL_SCALE;
+	if (du > duMax)
+		du = duMax;
+	else if (du < -duMax)
+		du = -duMax;
+
+	if (du > 0)
+		return (pos < target) ? moveToward(pos, target, du) : pos;
+
+	return moveToward(pos, 0, -du);
+}
+
+/**
+ * Alpha-beta tracker on the measured angle (Q8.8): the estimate is predicted
+ * with the last velocity, then both are corrected by a fraction of the
+ * residual. Called every control tick, fresh is false when the ADC has not
+ * published a new frame since the previous tick (with ADC_PWM_SYNC it does so
+ * once per PWM frame) and only the prediction is done.
+ */
+static void trackAngle(struct servo_data_t* sd, const uint16_t angle,
+		const bool fresh)
+{
+	int32_t meas = (int32_t) angle << 8;
+
+	if (sd->estValid && !fresh) {
+		sd->estAngle += sd->estVel;
+		return;
+	}
+
+	if (!sd->estValid) { // start from rest at the first reading
+		sd->estAngle = meas;
+		sd->estVel = 0;
+		sd->estValid = true;
+		return;
+	}
+
+	int32_t predicted = sd->estAngle + sd->estVel;
+	int32_t residual = meas - predicted;
+
+	sd->estAngle = predicted + (residual >> TRACK_ALPHA_SHIFT);
+	sd->estVel += residual >> TRACK_BETA_SHIFT;
+}
+
+/**
+ * Decide whether a finger in ANGLE mode can stop being driven: its reference
+ * must have reached the target and the measured angle must have stayed within
+ * the band of where it stopped for the settle time. Only measured angles are
+ * compared: the target goes through the PWM law and the reading through the
+ * ADC law, which on an uncalibrated servo may disagree by more than the band.
+ * A detached finger is attached again when it is pushed away from where it
+ * stopped. Returns true while detached.
+ */
+static bool idleUpdate(struct servo_data_t* sd, const uint32_t pos,
+		const uint32_t target, const uint8_t angle)
+{
+	uint8_t rest = sd->restAngle;
+	uint8_t dist = (rest > angle) ? (rest - angle) : (angle - rest);
+
+	if (sd->detached) {
+		if (dist <= sd->detachBand + DETACH_HYSTERESIS)
+			return true;
+
+		sd->detached = false; // drive it back
+		sd->idleTicks = 0;
+		sd->restAngle = angle;
+		return false;
+	}
+
+	if ((sd->detachTime == 0) || (pos != target) || (dist > sd->detachBand)) {
+		sd->idleTicks = 0; // still moving, settle around the new angle
+		sd->restAngle = angle;
+		return false;
+	}
+
+	if (++sd->idleTicks >= (uint16_t) sd->detachTime * (CONTROL_RATE_HZ / 10))
+		sd->detached = true;
+
+	return sd->detached;
+}
+
+/**
+ * Queue an event for the main loop. Called by the control loop only.
+ */
+static void pushEvent(const uint8_t servo_num, const uint8_t event)
+{
+	uint8_t next = (eventTail + 1) % EVENT_QUEUE_LEN;
+
+	if (next == eventHead)
+		return; // full, drop it
+
+	eventQueue[eventTail] = (servo_num << 4) | event;
+	eventTail = next;
+}
+
+/**
+ * Look for contact and stall of a finger in ANGLE or PID mode, at most one
+ * event per motion. Contact is a sudden rise of the current while the finger
+ * moves, stall is the measured angle staying far from the reference for
+ * STALL_TIME_MS. Returns true if an event has been raised.
+ */
+static bool detectEvent(const uint8_t i, const uint32_t pos,
+		const uint32_t target, const uint8_t angle, const uint8_t current,
+		const bool step)
+{
+	struct servo_data_t* sd = &sData[i];
+	uint8_t event = 0;
+	int16_t rise = 0;
+
+	if (step) { // the derivative is taken once per frame
+		rise = (int16_t) current - sd->lastCurrent;
+		sd->lastCurrent = current;
+	}
+
+	if (!(sd->eventFlags & WIFI_EVENTS_DETECT) || sd->eventLatched) {
+		sd->stallTicks = 0;
+		return false;
+	}
+
+	if ((pos != target) && (rise >= sd->contact_mA))
+		event = WIFI_EVENT_CONTACT;
+
+	uint8_t ref = POS2DEG(pos);
+	uint8_t dist = (ref > angle) ? (ref - angle) : (angle - ref);
+	if (dist < sd->stall_deg)
+		sd->stallTicks = 0;
+	else if (++sd->stallTicks >= (uint32_t) STALL_TIME_MS * CONTROL_RATE_HZ / 1000)
+		event = WIFI_EVENT_STALL;
+
+	if (event == 0)
+		return false;
+
+	sd->eventLatched = true;
+	sd->stallTicks = 0;
+	if (sd->eventFlags & WIFI_EVENTS_REPORT)
+		pushEvent(i, event);
+
+	return true;
+}
+
+/**
+ * Compute the new driving signal of a servo, checking that the current does
+ * not exceed the threshold. The PID only advances when step is set, once per
+ * PWM frame. The position is mapped to a compare value only here.
+ */
+static void updateServo(const uint8_t i, const struct ADC_Frame_t* f,
+		const bool step, const bool fresh)
+{
+	uint32_t pos = sData[i].position;
+	uint32_t target = DEG2POS(sData[i].targetAngle_deg);
+	uint8_t maxCurrent = sData[i].maxCurrent_mA;
+	uint8_t actualAngle = calib_adc2deg(i, f->angle[i]);
+	uint8_t actualCurrent = ADC_current2mA(f->current[i]);
+	uint8_t burstCurrent = ADC_getBurstCurrent(i); // for the limits
+	int16_t correction = 0; // added to the output by the PID
+	bool off = false; // no pulse at all
+
+	trackAngle(&sData[i], calib_adc2degQ8(i, f->angle[i]), fresh);
+
+	if (sData[i].status == PID)
+		correction = sData[i].correction; // held between PID updates
+
+	if ((sData[i].status == ANGLE) || (sData[i].status == PID)) {
+		if (detectEvent(i, pos, target, actualAngle, actualCurrent, step)
+				&& (sData[i].eventFlags & WIFI_EVENTS_HOLD)) {
+			// grip at the configured force from where the finger is
+			sData[i].status = HOLD;
+			sData[i].lastForceError = 0;
+			pos = DEG2POS(actualAngle);
+			correction = 0;
 		}
 	}
+
+	switch (sData[i].status)
+	{
+		case PID:
+			if (burstCurrent >= maxCurrent) {
+				off = true; // too much current. STOP!
+				sData[i].integral = 0;
+				break;
+			}
+
+			// move the reference like in ANGLE mode
+			pos = moveReference(&sData[i], pos, target);
+			if (step) {
+				correction = pidUpdate(&sData[i], POS2DEG(pos), actualAngle);
+				sData[i].correction = correction;
+			}
+			break;
+
+		case ANGLE:
+			if (burstCurrent >= maxCurrent) {
+				off = true; // too much current. STOP!
+			} else if (idleUpdate(&sData[i], pos, target, actualAngle)) {
+				off = true; // settled, save power
+			} else {
+				pos = moveReference(&sData[i], pos, target);
+			}
+			break;
+
+		case HOLD:
+			// NOTE: I'm supposing the hand is closed when the servo goes
+			// to 180 degrees and opened otherwhise
+			if (burstCurrent < maxCurrent) {
+				pos = forceUpdate(&sData[i], pos, target, actualCurrent);
+			} else { // back off as soon as the current is too high
+				pos = moveToward(pos, 0, DPS2VEL(HOLD_BACKOFF));
+				sData[i].lastForceError = 0;
+			}
+			break;
+
+		case FOLLOW:
+			off = true; // let the finger move freely
+			break;
+
+		case CALIBRATE: // keep the value chosen by servo_calibrate()
+			if (burstCurrent >= maxCurrent)
+				off = true;
+			break;
+	}
+
+	sData[i].position = pos;
+
+	// the new value is latched by the servo timer at its next TOP
+	uint16_t compVal;
+	if (sData[i].status == CALIBRATE) {
+		compVal = sData[i].calibComp;
+	} else {
+		compVal = calib_deg2compQ8(i, POS2DEGQ8(pos)) + correction;
+		compVal = max(compVal, SERVO_PWM_MIN);
+		compVal = min(compVal, SERVO_PWM_MAX);
+	}
+	if (off)
+		compVal = 0;
+	pending[i] = pulse2comp(&outputs[i], compVal);
+
+	uint8_t restore = tripped & (1 << i);
+	if (restore) { // the output has been cut, do not wait for the latch
+		*outputs[i].ccBuf = pending[i];
+		*outputs[i].ctrlB |= outputs[i].enable;
+	}
+	tripped &= ~restore;
+}
+
+/**
+ * Control loop, CONTROL_RATE_HZ times per second
+ */
+ISR(TCD1_OVF_vect)
+{
+	static uint8_t lastSeq = 0; // seq of the previous frame
+	struct ADC_Frame_t frame; // all the readings come from the same scan
+	ADC_getFrame(&frame);
+
+	bool fresh = (frame.seq != lastSeq);
+	lastSeq = frame.seq;
+
+	tickCount++;
+	bool step = (controlTick == 0);
+	controlTick = (controlTick + 1) % (CONTROL_RATE_HZ / FRAME_RATE_HZ);
+
+	for (uint8_t i = 0; i < 5; i++)
+		updateServo(i, &frame, step, fresh);
+}
+
+/**
+ * Latch the values computed by the control loop for the servos from first to
+ * last, all driven by the same timer. Called at TOP, the compare buffers are
+ * locked so that all the new values are loaded together at the next BOTTOM,
+ * where only the non inverted pulses are high.
+ */
+#define LATCH_GROUP( _tc, _first, _last ) do {                   \
+		TC_LockCompareUpdate(&(_tc));                               \
+		for (uint8_t i = (_first); i <= (_last); i++)               \
+			*outputs[i].ccBuf = pending[i];                         \
+		TC_UnlockCompareUpdate(&(_tc));                             \
+	} while (0)
+
+ISR(TCD0_OVF_vect)
+{
+	LATCH_GROUP(THUMB_TIMER, THUMB_FINGER, THUMB_FINGER);
+}
+
+ISR(TCC1_OVF_vect)
+{
+	LATCH_GROUP(INDEX_TIMER, INDEX_FINGER, MIDDLE_FINGER);
+}
+
+ISR(TCC0_OVF_vect)
+{
+	LATCH_GROUP(RING_TIMER, RING_FINGER, PINKY_FINGER);
+}
+
+void servo_trip(const uint8_t servo_num)
+{
+	// in HOLD mode crossing the limit is part of the normal regulation
+	servo_state_t st = sData[servo_num].status;
+	if ((st != ANGLE) && (st != PID) && (st != CALIBRATE))
+		return;
+
+	// stop the pulse right now: the compare value is cleared bypassing the
+	// buffer and the pin is disconnected until updateServo() restores it
+	const struct servo_output_t* o = &outputs[servo_num];
+	*o->cc = pulse2comp(o, 0);
+	*o->ccBuf = pulse2comp(o, 0);
+	*o->ctrlB &= ~o->enable;
+
+	tripped |= (1 << servo_num);
+	faults |= (1 << servo_num);
+}
+
+uint8_t servo_getFaults()
+{
+	AVR_ENTER_CRITICAL_REGION();
+	uint8_t f = faults;
+	faults = 0;
+	AVR_LEAVE_CRITICAL_REGION();
+
+	return f;
 }
 
 void servo_setMode(const servo_state_t mode)
 {
+	// 16 bit values used by the control loop: no torn writes, no reset lost
+	// to the ISR
+	AVR_ENTER_CRITICAL_REGION();
+	for (int i = 0; i < 5; i++) { // start the regulators from scratch
+		sData[i].integral = 0;
+		sData[i].correction = 0;
+		// no derivative kick at the first PID update
+		sData[i].lastAngle = ADC_getServoAngle(i);
+		sData[i].lastForceError = 0;
+	}
+	AVR_LEAVE_CRITICAL_REGION();
+
 	if (status != FOLLOW) {
 		status = mode;
 
 		for (int i = 0; i < 5; i++) {
 			sData[i].status = mode;
+			planMotion(i);
 		}
 	} else {
 		status = mode;
@@ -177,6 +806,25 @@ void servo_setAngle(const uint8_t servo_num, const uint8_t angle)
 
 	sData[servo_num].targetAngle_deg = a;
 	sData[servo_num].status = status;
+	planMotion(servo_num);
+}
+
+void servo_movePose(const uint8_t angles[5], const uint16_t duration_ms)
+{
+	uint16_t ticks = ((uint32_t) duration_ms * CONTROL_RATE_HZ) / 1000;
+	ticks = max(ticks, 1);
+
+	// all the plans start at the same control loop tick
+	AVR_ENTER_CRITICAL_REGION();
+	for (uint8_t i = 0; i < 5; i++) {
+		if (angles[i] == 0)
+			continue; // not part of the pose
+
+		sData[i].targetAngle_deg = min(angles[i], 180);
+		sData[i].status = status;
+		planTimed(i, ticks);
+	}
+	AVR_LEAVE_CRITICAL_REGION();
 }
 
 void servo_setCurrent(const uint8_t servo_num, const uint8_t current_mA)
@@ -186,6 +834,7 @@ void servo_setCurrent(const uint8_t servo_num, const uint8_t current_mA)
 
 	sData[servo_num].maxCurrent_mA = current_mA;
 	sData[servo_num].status = status;
+	ADC_setTripCurrent(servo_num, current_mA);
 }
 
 void servo_setSpeed(const uint8_t servo_num, const uint8_t speed)
@@ -193,23 +842,230 @@ void servo_setSpeed(const uint8_t servo_num, const uint8_t speed)
 	if (servo_num > 4)
 		return;
 
+	AVR_ENTER_CRITICAL_REGION();
 	sData[servo_num].speed = speed;
+	sData[servo_num].vmax = DPS2VEL(speed);
 	sData[servo_num].status = status;
+	AVR_LEAVE_CRITICAL_REGION();
+	planMotion(servo_num);
+}
+
+void servo_setParam(const uint8_t servo_num, const uint8_t param,
+		const uint8_t value)
+{
+	if (servo_num > 4)
+		return;
+
+	bool replan = false;
+
+	// gains and regulator state are 16 bit values used by the control loop:
+	// no torn writes, no reset lost to the ISR
+	AVR_ENTER_CRITICAL_REGION();
+	switch (param) {
+		case WIFI_PARAM_KP:
+			sData[servo_num].kp = (uint16_t) value << 4;
+			break;
+
+		case WIFI_PARAM_KI:
+			sData[servo_num].ki = (uint16_t) value << 4;
+			sData[servo_num].integral = 0;
+			break;
+
+		case WIFI_PARAM_KD:
+			sData[servo_num].kd = (uint16_t) value << 4;
+			break;
+
+		case WIFI_PARAM_ACCEL:
+			sData[servo_num].accel = value;
+			sData[servo_num].amax = ACCEL2TICK(value);
+			replan = true;
+			break;
+
+		case WIFI_PARAM_PEAK:
+			ADC_resetPeakCurrent(servo_num);
+			break;
+
+		case WIFI_PARAM_FORCE:
+			sData[servo_num].force_mA = value;
+			break;
+
+		case WIFI_PARAM_FORCE_KP:
+			sData[servo_num].fkp = (uint16_t) value << 4;
+			break;
+
+		case WIFI_PARAM_FORCE_KI:
+			sData[servo_num].fki = (uint16_t) value << 4;
+			break;
+
+		case WIFI_PARAM_FORCE_BAND:
+			sData[servo_num].forceBand = value;
+			break;
+
+		case WIFI_PARAM_FORCE_RATE:
+			sData[servo_num].forceRate = value;
+			break;
+
+		case WIFI_PARAM_EVENTS:
+			sData[servo_num].eventFlags = value;
+			break;
+
+		case WIFI_PARAM_CONTACT:
+			sData[servo_num].contact_mA = value;
+			break;
+
+		case WIFI_PARAM_STALL:
+			sData[servo_num].stall_deg = value;
+			break;
+
+		case WIFI_PARAM_DETACH:
+			sData[servo_num].detachTime = value;
+			break;
+
+		case WIFI_PARAM_DETACH_BAND:
+			sData[servo_num].detachBand = value;
+			break;
+	}
+	AVR_LEAVE_CRITICAL_REGION();
+
+	if (replan)
+		planMotion(servo_num);
+}
+
+uint8_t servo_getParam(const uint8_t servo_num, const uint8_t param)
+{
+	switch (param) {
+		case WIFI_PARAM_KP:
+			return min(sData[servo_num].kp >> 4, 255);
+
+		case WIFI_PARAM_KI:
+			return min(sData[servo_num].ki >> 4, 255);
+
+		case WIFI_PARAM_KD:
+			return min(sData[servo_num].kd >> 4, 255);
+
+		case WIFI_PARAM_ACCEL:
+			return sData[servo_num].accel;
+
+		case WIFI_PARAM_PEAK:
+			return ADC_getPeakCurrent(servo_num);
+
+		case WIFI_PARAM_FORCE:
+			return sData[servo_num].force_mA;
+
+		case WIFI_PARAM_FORCE_KP:
+			return min(sData[servo_num].fkp >> 4, 255);
+
+		case WIFI_PARAM_FORCE_KI:
+			return min(sData[servo_num].fki >> 4, 255);
+
+		case WIFI_PARAM_FORCE_BAND:
+			return sData[servo_num].forceBand;
+
+		case WIFI_PARAM_FORCE_RATE:
+			return sData[servo_num].forceRate;
+
+		case WIFI_PARAM_EVENTS:
+			return sData[servo_num].eventFlags;
+
+		case WIFI_PARAM_CONTACT:
+			return sData[servo_num].contact_mA;
+
+		case WIFI_PARAM_STALL:
+			return sData[servo_num].stall_deg;
+
+		case WIFI_PARAM_DETACH:
+			return sData[servo_num].detachTime;
+
+		case WIFI_PARAM_DETACH_BAND:
+			return sData[servo_num].detachBand;
+	}
+
+	return 0;
 }
 
 uint8_t servo_getAngle(const uint8_t servo_num)
 {
-	uint16_t actPWM = sData[servo_num].controlPWM / SPEED_DIVIDER;
-	actPWM -= SERVO_PWM_MIN;
-	return (actPWM * 9) / 100;
+	AVR_ENTER_CRITICAL_REGION();
+	uint32_t pos = sData[servo_num].position;
+	AVR_LEAVE_CRITICAL_REGION();
+
+	return POS2DEG(pos);
+}
+
+void servo_calibrate(const uint8_t servo_num, const uint16_t comp)
+{
+	if (servo_num > 4)
+		return;
+
+	AVR_ENTER_CRITICAL_REGION();
+	if (comp == 0) { // done, keep the last position
+		uint8_t deg = calib_comp2deg(servo_num, sData[servo_num].calibComp);
+		sData[servo_num].position = DEG2POS(deg);
+		sData[servo_num].lastAngle = ADC_getServoAngle(servo_num);
+		sData[servo_num].integral = 0;
+		sData[servo_num].status = status;
+	} else {
+		sData[servo_num].calibComp = comp;
+		sData[servo_num].status = CALIBRATE;
+	}
+	AVR_LEAVE_CRITICAL_REGION();
 }
 
 uint8_t servo_getSpeed(const uint8_t servo_num)
 {
-	uint8_t current = ADC_getServoCurrent(servo_num);
+	int32_t vel = servo_getVelocity(servo_num);
+	uint32_t dps = (vel < 0) ? -vel : vel;
 
-	if ((current > 10) && (current < sData[servo_num].maxCurrent_mA))
-		return sData[servo_num].speed;
+	return min((dps + 0x8000) >> 16, 255);
+}
 
-	return 0;
+int32_t servo_getVelocity(const uint8_t servo_num)
+{
+	AVR_ENTER_CRITICAL_REGION();
+	int32_t vel = sData[servo_num].estVel;
+	AVR_LEAVE_CRITICAL_REGION();
+
+	return vel * CONTROL_RATE_HZ;
+}
+
+bool servo_getEvent(uint8_t* servo_num, uint8_t* event)
+{
+	if (eventHead == eventTail)
+		return false;
+
+	uint8_t e = eventQueue[eventHead];
+	eventHead = (eventHead + 1) % EVENT_QUEUE_LEN;
+
+	*servo_num = e >> 4;
+	*event = e & 0x0F;
+	return true;
+}
+
+uint16_t servo_getTicks()
+{
+	AVR_ENTER_CRITICAL_REGION();
+	uint16_t t = tickCount;
+	AVR_LEAVE_CRITICAL_REGION();
+
+	return t;
+}
+
+uint8_t servo_getTarget(const uint8_t servo_num)
+{
+	return sData[servo_num].targetAngle_deg;
+}
+
+uint8_t servo_getMaxSpeed(const uint8_t servo_num)
+{
+	return sData[servo_num].speed;
+}
+
+uint8_t servo_getMaxCurrent(const uint8_t servo_num)
+{
+	return sData[servo_num].maxCurrent_mA;
+}
+
+servo_state_t servo_getMode(const uint8_t servo_num)
+{
+	return sData[servo_num].status;
 }
@@ -0,0 +1,114 @@
+/**
+ * Implementation for telemetry_driver.h
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+#include <string.h>
+
+#include "include/board.h"
+#include "include/adc_driver.h"
+#include "include/calib_driver.h"
+#include "include/esp_driver.h"
+#include "include/servo_driver.h"
+#include "include/utils.h"
+
+#include "include/telemetry_driver.h"
+
+static uint8_t  rate = 0;     // frames per second, 0 when stopped
+static uint16_t credit = 0;   // frames owed, times CONTROL_RATE_HZ
+static uint16_t lastTick = 0; // tick of the last poll
+static uint8_t  count = 0;    // frame counter, sent in the header
+static uint8_t  client = 0;   // wifi connection of the subscriber
+
+/**
+ * WIFI_MODE_* value of a servo mode. CALIBRATE has no wifi counterpart and is
+ * reported as 0xFF.
+ */
+static uint8_t mode2wifi(const servo_state_t mode)
+{
+	switch (mode) {
+		case FOLLOW: return WIFI_MODE_FOLLOW;
+		case ANGLE:  return WIFI_MODE_ANGLE;
+		case HOLD:   return WIFI_MODE_HOLD;
+		case PID:    return WIFI_MODE_PID;
+		default:     return 0xFF;
+	}
+}
+
+/**
+ * Take a snapshot of the hand and queue it as one frame
+ */
+static void sendFrame()
+{
+	uint8_t data[TELEMETRY_WORDS * 2];
+	struct ADC_Frame_t frame;
+	union wifiCommand cmd;
+
+	// a partial frame would leave the host out of sync: skip the whole
+	// frame, the gap in the counter tells the host
+	if (esp_txFree() < TELEMETRY_WORDS + 1) {
+		count++;
+		return;
+	}
+
+	ADC_getFrame(&frame);
+	for (uint8_t i = 0; i < 5; i++) {
+		int32_t vel = servo_getVelocity(i) >> 12; // Q16.16 to Q12.4
+		vel = max(min(vel, INT16_MAX), INT16_MIN);
+
+		data[i] = calib_adc2deg(i, frame.angle[i]);
+		data[5 + i] = ADC_current2mA(frame.current[i]);
+		data[10 + 2 * i] = vel & 0xFF;
+		data[11 + 2 * i] = (vel >> 8) & 0xFF;
+		data[20 + i] = mode2wifi(servo_getMode(i));
+	}
+	data[25] = frame.battery >> 8;
+
+	cmd.field.command = WIFI_TELEMETRY;
+	cmd.field.servo = WIFI_TELEMETRY_FRAME;
+	cmd.field.data = count++;
+	esp_sendCommandTo(cmd, client);
+
+	// the words are sent as they are stored
+	for (uint8_t i = 0; i < TELEMETRY_WORDS; i++) {
+		memcpy(&cmd, &data[2 * i], 2);
+		esp_sendCommandTo(cmd, client);
+	}
+	esp_flush(); // one AT+CIPSEND for the whole frame
+}
+
+void telemetry_setRate(const uint8_t rate_hz, const uint8_t link)
+{
+	rate = min(rate_hz, TELEMETRY_MAX_HZ);
+	client = link;
+	credit = CONTROL_RATE_HZ; // the first frame right now
+	lastTick = servo_getTicks();
+}
+
+uint8_t telemetry_getRate()
+{
+	return rate;
+}
+
+void telemetry_close(const uint8_t link)
+{
+	if (link == client)
+		rate = 0;
+}
+
+void telemetry_poll()
+{
+	if (rate == 0)
+		return;
+
+	uint16_t now = servo_getTicks();
+	uint16_t elapsed = now - lastTick;
+	lastTick = now;
+
+	// any rate is kept on average, a slow main loop skips frames
+	credit = min(credit + (uint32_t) elapsed * rate, 2 * CONTROL_RATE_HZ);
+	if (credit >= CONTROL_RATE_HZ) {
+		credit %= CONTROL_RATE_HZ;
+		sendFrame();
+	}
+}
@@ -0,0 +1,174 @@
+/**
+ * Benchmark for the fixed point conversion kernels in fixmath.h.
+ *
+ * This is a firmware image for the board, not a host program. Every kernel is
+ * run over its whole input range, both in its fixed point version and in the
+ * plain multiply/divide version it replaces. The worst case and the average
+ * number of CPU cycles of each one are printed through the serial port,
+ * together with the number of results that differ.
+ * Build it with 'make bench' and flash fixbench.hex.
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+#include "include/board.h"
+#include "include/avr_compiler.h"
+#include "include/clksys_driver.h"
+#include "include/TC_driver.h"
+#include "include/serio_driver.h"
+#include "include/fixmath.h"
+
+// timer clocked by the CPU clock, used to count cycles
+#define CYCLE_TIMER TCD1
+
+// results are stored here so that the compiler can not optimize them out
+static volatile uint16_t sink;
+
+/*
+ * Reference implementations, as they were before fixmath.h
+ */
+static uint16_t __attribute__((noinline)) ref_deg2comp(uint8_t angle)
+{
+	return SERVO_PWM_MIN + ((angle * 25) / 9) * 4; // (MAX-MIN) / 180
+}
+
+static uint8_t __attribute__((noinline)) ref_comp2deg(uint16_t comp)
+{
+	uint16_t actPWM = comp - SERVO_PWM_MIN;
+	return (actPWM * 9) / 100;
+}
+
+static uint8_t __attribute__((noinline)) ref_adc2deg(uint16_t angle16)
+{
+	uint16_t tempA = angle16 >> 5;
+	tempA = (tempA * 9) / 32;
+	tempA = (tempA * 5) / 16;
+	return tempA;
+}
+
+// non inlined wrappers, so that both versions pay the same call overhead
+static uint16_t __attribute__((noinline)) fix_deg2comp_call(uint8_t angle)
+{
+	return fix_deg2comp(angle);
+}
+
+static uint8_t __attribute__((noinline)) fix_comp2deg_call(uint16_t comp)
+{
+	return fix_comp2deg(comp);
+}
+
+static uint8_t __attribute__((noinline)) fix_adc2deg_call(uint16_t angle16)
+{
+	return fix_adc2deg(angle16);
+}
+
+struct bench_result {
+	uint16_t maxCycles;
+	uint32_t totCycles;
+	uint16_t runs;
+	uint16_t mismatches;
+};
+
+/**
+ * Time a single statement in CPU cycles, removing the measurement overhead
+ */
+#define TIME(_stmt, _res) do {                                 \
+		uint16_t _t0 = CYCLE_TIMER.CNT;                \
+		_stmt;                                         \
+		uint16_t _dt = CYCLE_TIMER.CNT - _t0 - overhead; \
+		(_res)->totCycles += _dt;                      \
+		(_res)->runs++;                                \
+		if (_dt > (_res)->maxCycles)                   \
+			(_res)->maxCycles = _dt;               \
+	} while (0)
+
+static uint16_t overhead;
+
+void printNum(uint32_t n)
+{
+	char buf[11];
+	ultoa(n, buf, 10);
+	serio_putString(buf);
+}
+
+void printResult(char* name, struct bench_result* res)
+{
+	serio_putString(name);
+	serio_putString(": max ");
+	printNum(res->maxCycles);
+	serio_putString(" avg ");
+	printNum(res->totCycles / res->runs);
+	serio_putString(" diff ");
+	printNum(res->mismatches);
+	serio_putString("\r\n");
+}
+
+int main(void)
+{
+	CLKSYS_XOSC_Config(OSC_FRQRANGE_12TO16_gc, false,
+			OSC_XOSCSEL_XTAL_256CLK_gc);
+	CLKSYS_Enable(OSC_XOSCEN_bm);
+	do {} while ( CLKSYS_IsReady(OSC_XOSCRDY_bm) == 0);
+	CLKSYS_Main_ClockSource_Select(CLK_SCLKSEL_XOSC_gc);
+
+	serio_init();
+	PMIC.CTRL = PMIC_HILVLEN_bm;
+	sei();
+
+	TC_SetPeriod(&CYCLE_TIMER, 0xFFFF);
+	TC1_ConfigWGM(&CYCLE_TIMER, TC_WGMODE_NORMAL_gc);
+	TC1_ConfigClockSource(&CYCLE_TIMER, TC_CLKSEL_DIV1_gc);
+
+	// cost of reading the timer twice
+	uint16_t t0 = CYCLE_TIMER.CNT;
+	overhead = CYCLE_TIMER.CNT - t0;
+
+	struct bench_result fix = {0, 0, 0, 0}, ref = {0, 0, 0, 0};
+	serio_putString("\r\nfixmath benchmark (CPU cycles)\r\n");
+
+	// degrees -> compare value
+	for (uint8_t a = 0; a <= 180; a++) {
+		uint16_t r1, r2;
+		cli(); // do not count the serial port interrupt
+		TIME(r1 = ref_deg2comp(a), &ref);
+		TIME(r2 = fix_deg2comp_call(a), &fix);
+		sei();
+		sink = r1 + r2;
+		if (r1 != r2)
+			fix.mismatches++;
+	}
+	printResult("deg2comp ref", &ref);
+	printResult("deg2comp fix", &fix);
+
+	// compare value -> degrees
+	fix = ref = (struct bench_result) {0, 0, 0, 0};
+	for (uint16_t c = SERVO_PWM_MIN; c <= SERVO_PWM_MAX; c++) {
+		uint8_t r1, r2;
+		cli();
+		TIME(r1 = ref_comp2deg(c), &ref);
+		TIME(r2 = fix_comp2deg_call(c), &fix);
+		sei();
+		sink = r1 + r2;
+		if (r1 != r2)
+			fix.mismatches++;
+	}
+	printResult("comp2deg ref", &ref);
+	printResult("comp2deg fix", &fix);
+
+	// ADC reading -> degrees. The fixed point version rounds only once so it
+	// may differ by 1 degree from the reference
+	fix = ref = (struct bench_result) {0, 0, 0, 0};
+	for (uint16_t v = 0; v < 0xFFE0; v += 32) {
+		uint8_t r1, r2;
+		cli();
+		TIME(r1 = ref_adc2deg(v), &ref);
+		TIME(r2 = fix_adc2deg_call(v), &fix);
+		sei();
+		sink = r1 + r2;
+		if (r1 != r2)
+			fix.mismatches++;
+	}
+	printResult("adc2deg ref", &ref);
+	printResult("adc2deg fix", &fix);
+
+	while (1) {;}
+}
@@ -0,0 +1,135 @@
+/**
+ * Tester program for 'thing'.
+ *
+ * This program subscribes to the telemetry frames (WIFI_PARAM_TELEMETRY) and
+ * prints them as they come. The board stops the frames when the connection
+ * is closed.
+ *
+ * See telemetry_driver.h for the layout of a frame.
+ *
+ * Copyright (C) 2016 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <bsd/stdlib.h> // requires libbsd-dev
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "include/board.h" // use the same header as the firmware
+#include "include/telemetry_driver.h"
+
+#define BOARD_IP   "192.168.4.1"
+#define BOARD_PORT 333
+
+const char* USAGE_STR = "Usage: %s [rate]\n\n"
+                        "Options;\n"
+                        "    rate\tFrames per second, between 1 (default) and "
+                        "100\n";
+
+/**
+ * Read exactly len bytes, return 0 when the connection is closed
+ */
+int readAll(int socket_desc, void* buf, size_t len)
+{
+	uint8_t* ptr = buf;
+	while (len > 0) {
+		ssize_t n = read(socket_desc, ptr, len);
+		if (n <= 0)
+			return 0;
+		ptr += n;
+		len -= n;
+	}
+	return 1;
+}
+
+void sendCommand(int socket_desc, uint8_t command, uint8_t data)
+{
+	union wifiCommand_le cmd; // Sending is little endian
+	cmd.field.command = command;
+	cmd.field.servo = 0;
+	cmd.field.data = data;
+	send(socket_desc, &cmd, sizeof(cmd), 0);
+}
+
+int main(int argc, char *argv[])
+{
+	int rate = 1; // default rate
+
+	// parse rate (if any)
+	if (argc == 2) {
+		const char* estr;
+		rate = strtonum(argv[1], 1, TELEMETRY_MAX_HZ, &estr);
+
+		if (estr != NULL) {
+			fprintf(stderr, "Could not parse the rate. Reason: %s\n\n", estr);
+			printf(USAGE_STR, argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// create the socket
+	int socket_desc = socket(AF_INET , SOCK_STREAM , 0);
+	if (socket_desc == -1) {
+		fprintf(stderr, "Could not create socket.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct sockaddr_in board;
+	board.sin_addr.s_addr = inet_addr(BOARD_IP);
+	board.sin_family = AF_INET;
+	board.sin_port = htons(BOARD_PORT);
+
+	if (connect(socket_desc, (struct sockaddr *)&board , sizeof(board)) < 0)
+	{
+		fprintf(stderr, "Error connecting to target board\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// subscribe
+	sendCommand(socket_desc, WIFI_SEL_PARAM, WIFI_PARAM_TELEMETRY);
+	sendCommand(socket_desc, WIFI_SET_PARAM, rate);
+
+	// loop
+	union wifiCommand answer; // receiving is not little endian
+	uint8_t data[TELEMETRY_WORDS * 2];
+	uint8_t count = 0;
+	int first = 1;
+	while (readAll(socket_desc, &answer, sizeof(answer))) {
+		if (answer.field.command == WIFI_SET_PARAM) {
+			printf("Rate: %u Hz\n", answer.field.data);
+			continue;
+		}
+		if ((answer.field.command == WIFI_EVENT)
+				&& (answer.field.servo < 5)) {
+			printf("Event %u on servo %u\n", answer.field.data,
+				answer.field.servo);
+			continue;
+		}
+		if ((answer.field.command != WIFI_TELEMETRY)
+				|| (answer.field.servo != WIFI_TELEMETRY_FRAME))
+			continue; // answer to some other command
+
+		if (!readAll(socket_desc, data, sizeof(data)))
+			break;
+
+		if (!first && (answer.field.data != count))
+			printf("%u frames lost\n", (uint8_t) (answer.field.data - count));
+		count = answer.field.data + 1;
+		first = 0;
+
+		printf("Frame %u, battery %u\n", answer.field.data, data[25]);
+		for (int i = 0; i < 5; i++) {
+			int16_t vel = data[10 + 2 * i] | (data[11 + 2 * i] << 8);
+			printf("\tServo %d: angle %u, current %u mA, speed %.1f, "
+				"mode %u\n", i, data[i], data[5 + i], vel / 16.0,
+				data[20 + i]);
+		}
+	}
+
+	close(socket_desc);
+	return 0;
+}
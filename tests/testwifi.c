@@ -27,9 +27,9 @@ const char* USAGE_STR = "Usage: %s [options] [value]\n\n"
                         "   -a\tSet the angle value\n"
                         "   -c\tSet maximum current\n"
                         "   -h\tDisplay this help text\n"
-                        "   -m\tChange operating mode (A, H or F)\n"
+                        "   -m\tChange operating mode (A, H, F or P)\n"
                         "   -n\tSet servo number\n"
-                        "   -s\tSet rotation speed\n";
+                        "   -s\tSet rotation speed (degrees/s)\n";
 
 void parseCmdLine(int argc, char *argv[],int* m_ptr, int*n_ptr, int* a_ptr,
 			int* s_ptr, int* c_ptr)
@@ -66,8 +66,10 @@ void parseCmdLine(int argc, char *argv[],int* m_ptr, int*n_ptr, int* a_ptr,
 					*m_ptr = WIFI_MODE_ANGLE;
 				else if (*optarg == 'H')
 					*m_ptr = WIFI_MODE_HOLD;
+				else if (*optarg == 'P')
+					*m_ptr = WIFI_MODE_PID;
 				else {
-					fprintf(stderr, "Invalid mode: %s. Expected F, A or H\n",
+					fprintf(stderr, "Invalid mode: %s. Expected F, A, H or P\n",
 						optarg);
 					exit(EXIT_FAILURE);
 				}
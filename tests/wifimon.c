@@ -5,8 +5,8 @@
  * The goal is to monitor current, speed and angle of each servo at a fixed
  * rate.
  *
- * NOTE: due to the fact that answers are always sent to channel 0 of the
- * ESP8266, this should be the first test program to be launched.
+ * Answers are sent to the connection the request comes from, so this program
+ * can run together with the other ones.
  *
  * Copyright (C) 2015 Paolo Scaramuzza <paolo.scaramuzza@ipol.gq>
  */